@@ -0,0 +1,887 @@
+/**
+ *  @file bench.cpp
+ *  @description timing harness for the Stats and ImgTree implementations in CPSC 221 PA3
+ *
+ *  USAGE: run with an optional image path and an optional directory for out-of-core and
+ *  cached Stats tables (default /tmp) as the command-line parameters, e.g.:
+ *  ./bench images-orig/kkkk-kmnn-960x540.png /var/tmp
+ *
+ *  Build with "make bench"; the harness is compiled with optimizations enabled,
+ *  unlike the pa3 test executable.
+ *
+ *  THIS FILE WILL NOT BE SUBMITTED TO PRAIRIELEARN
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <sys/resource.h>
+
+#include "cs221util/lodepng/lodepng.h"
+#include "imgtree.h"
+#include "stats-simd.h"
+
+using namespace cs221util;
+using namespace std;
+
+// Benchmark function declarations
+void BenchStatsLayouts(const PNG& img);
+void BenchStatsBuildThreads(const PNG& img);
+void BenchRowPrefixKernels(const PNG& img);
+void BenchStatsSpill(const PNG& img, const string& spillDirectory);
+void BenchStatsCache(const PNG& img, const string& cacheDirectory);
+void BenchStatsUpdate(const PNG& img);
+void BenchStatsDecode(const string& path);
+void BenchSplitScores(const PNG& img);
+void BenchSplitSweepKernels(const PNG& img);
+void BenchImgTreeBuildThreads(const PNG& img);
+void BenchImgTreeTraversals(const PNG& img);
+void BenchImgTreeBuildPruned(const PNG& img);
+void BenchImgTreeLeafBudget(const PNG& img);
+void BenchImgTreeApproximateSplits(const PNG& img);
+void BenchImgTreeSplitCache(const PNG& img, const string& cacheDirectory);
+void BenchImgTreeBothOrientations(const PNG& img);
+void BenchImgTreeQuadSplits(const PNG& img);
+
+// Benchmark support functions
+double ElapsedMs(chrono::steady_clock::time_point start);
+bool SameTables(const Stats& s1, const Stats& s2);
+void PageFaults(long& minor, long& major);
+double MeanSquaredError(const PNG& img, const PNG& rendered);
+
+// Program entry point
+int main(int argc, char *argv[])
+{
+	string input_img_path = "images-orig/kkkk-kmnn-960x540.png";
+	if (argc > 1)
+		input_img_path = argv[1];
+	string spill_dir = "/tmp";
+	if (argc > 2)
+		spill_dir = argv[2];
+
+	PNG inputimg;
+	if (!inputimg.readFromFile(input_img_path))
+		return 1;
+	cout << "Benchmarking " << input_img_path << " (" << inputimg.width() << "x" << inputimg.height() << ")\n" << endl;
+
+	BenchStatsLayouts(inputimg);
+	BenchStatsBuildThreads(inputimg);
+	BenchRowPrefixKernels(inputimg);
+	BenchStatsSpill(inputimg, spill_dir);
+	BenchStatsCache(inputimg, spill_dir);
+	BenchStatsUpdate(inputimg);
+	BenchStatsDecode(input_img_path);
+	BenchSplitScores(inputimg);
+	BenchSplitSweepKernels(inputimg);
+	BenchImgTreeBuildThreads(inputimg);
+	BenchImgTreeTraversals(inputimg);
+	BenchImgTreeBuildPruned(inputimg);
+	BenchImgTreeLeafBudget(inputimg);
+	BenchImgTreeApproximateSplits(inputimg);
+	BenchImgTreeSplitCache(inputimg, spill_dir);
+	BenchImgTreeBothOrientations(inputimg);
+	BenchImgTreeQuadSplits(inputimg);
+
+	return 0;
+}
+
+// Benchmark function implementations
+
+/**
+ *  Compares the planar, interleaved and blocked Stats layouts: construction time, and the time to
+ *  score every split candidate the way ImgTree::FindBestSplit does (two GetSumSqDev calls
+ *  per candidate line) over a set of horizontal bands and vertical strips of the image.
+ */
+void BenchStatsLayouts(const PNG& img)
+{
+	cout << "Entered BenchStatsLayouts..." << endl;
+
+	StatsOptions layouts[3];
+	layouts[0].layout = StatsLayout::Planar;
+	layouts[1].layout = StatsLayout::Interleaved;
+	layouts[2].layout = StatsLayout::Blocked;
+	const char* names[] = {"planar", "interleaved", "blocked"};
+	double checksums[3] = {0.0, 0.0, 0.0};
+	unsigned int w = img.width();
+	unsigned int h = img.height();
+
+	for (int l = 0; l < 3; l++)
+	{
+		auto start = chrono::steady_clock::now();
+		Stats s(img, layouts[l]);
+		double buildMs = ElapsedMs(start);
+
+		// bands of 1..16 rows, each scored along every vertical cut, and the transposed strips
+		double checksum = 0.0;
+		unsigned long queries = 0;
+		start = chrono::steady_clock::now();
+		for (unsigned int band = 1; band <= 16; band++)
+		{
+			for (unsigned int upr = 0; upr + band <= h; upr += band)
+			{
+				unsigned int lwr = upr + band - 1;
+				for (unsigned int i = 0; i + 1 < w; i++)
+				{
+					checksum += s.GetSumSqDev(upr, 0, lwr, i) + s.GetSumSqDev(upr, i + 1, lwr, w - 1);
+					queries += 2;
+				}
+			}
+			for (unsigned int lft = 0; lft + band <= w; lft += band)
+			{
+				unsigned int rt = lft + band - 1;
+				for (unsigned int i = 0; i + 1 < h; i++)
+				{
+					checksum += s.GetSumSqDev(0, lft, i, rt) + s.GetSumSqDev(i + 1, lft, h - 1, rt);
+					queries += 2;
+				}
+			}
+		}
+		double queryMs = ElapsedMs(start);
+		checksums[l] = checksum;
+
+		cout << names[l] << " (" << s.entryBytes * 8 << "-bit entries, "
+			 << (double)s.MemoryBytes() / ((double)w * h) << " bytes/pixel):\tbuild " << buildMs << " ms,\t" << queries << " GetSumSqDev calls in "
+			 << queryMs << " ms (" << queryMs * 1e6 / queries << " ns/call)" << endl;
+	}
+
+	cout << "Layouts agree: " << (checksums[0] == checksums[1] && checksums[0] == checksums[2] ? "yes" : "NO") << endl;
+
+	cout << "Leaving BenchStatsLayouts...\n"
+		 << endl;
+}
+
+/**
+ *  Times the Stats constructor with 1, 2, 4, ... threads up to the hardware thread count,
+ *  and checks every threaded build against the serial one entry by entry.
+ */
+void BenchStatsBuildThreads(const PNG& img)
+{
+	cout << "Entered BenchStatsBuildThreads..." << endl;
+
+	unsigned int maxThreads = max(1u, thread::hardware_concurrency());
+	StatsOptions opts;
+	Stats serial(img, opts);
+
+	for (unsigned int threads = 1; ; threads *= 2)
+	{
+		threads = min(threads, maxThreads);
+		opts.threads = threads;
+		auto start = chrono::steady_clock::now();
+		Stats s(img, opts);
+		double buildMs = ElapsedMs(start);
+
+		cout << threads << " thread(s):\tbuild " << buildMs << " ms,\tidentical to serial: "
+			 << (SameTables(serial, s) ? "yes" : "NO") << endl;
+		if (threads == maxThreads)
+			break;
+	}
+
+	cout << "Leaving BenchStatsBuildThreads...\n"
+		 << endl;
+}
+
+/**
+ *  Times each row prefix kernel the CPU supports over every row of the image (packed as RGBA8),
+ *  and checks that all of them produce the scalar kernel's output.
+ */
+void BenchRowPrefixKernels(const PNG& img)
+{
+	cout << "Entered BenchRowPrefixKernels..." << endl;
+	cout << "Kernel selected at runtime: " << SimdLevelName(BestSimdLevel()) << endl;
+
+	unsigned int w = img.width();
+	unsigned int h = img.height();
+	vector<unsigned char> rgba(4 * (size_t)w * h);
+	for (unsigned int y = 0; y < h; y++)
+	{
+		for (unsigned int x = 0; x < w; x++)
+		{
+			RGBAPixel* px = img.getPixel(x, y);
+			unsigned char* dst = &rgba[4 * ((size_t)y * w + x)];
+			dst[0] = px->r;
+			dst[1] = px->g;
+			dst[2] = px->b;
+			dst[3] = static_cast<unsigned char>(px->a * 255.0);
+		}
+	}
+
+	const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2};
+	const int repeats = 20;
+	vector<uint64_t> expected(8 * (size_t)w);
+	vector<uint64_t> out(8 * (size_t)w);
+	for (SimdLevel level : levels)
+	{
+		RowPrefixKernel kernel = RowPrefixKernelFor(level);
+		if (kernel == nullptr)
+		{
+			cout << SimdLevelName(level) << ":\tnot supported on this CPU" << endl;
+			continue;
+		}
+
+		bool match = true;
+		auto start = chrono::steady_clock::now();
+		for (int rep = 0; rep < repeats; rep++)
+		{
+			for (unsigned int y = 0; y < h; y++)
+			{
+				uint64_t carry[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+				kernel(&rgba[4 * (size_t)y * w], w, carry, out.data());
+				if (rep == 0)
+				{
+					uint64_t scalarCarry[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+					RowPrefixScalar(&rgba[4 * (size_t)y * w], w, scalarCarry, expected.data());
+					match = match && expected == out;
+				}
+			}
+		}
+		double ms = ElapsedMs(start);
+
+		cout << SimdLevelName(level) << ":\t" << ms * 1e6 / ((double)repeats * w * h) << " ns/pixel,\tmatches scalar: "
+			 << (match ? "yes" : "NO") << endl;
+	}
+
+	cout << "Leaving BenchRowPrefixKernels...\n"
+		 << endl;
+}
+
+/**
+ *  Compares Stats tables on the heap with tables in a memory-mapped spill file: page faults and
+ *  time to build the tables alone, and to build a whole ImgTree on top of them.
+ */
+void BenchStatsSpill(const PNG& img, const string& spillDirectory)
+{
+	cout << "Entered BenchStatsSpill..." << endl;
+
+	StatsOptions opts[2];
+	opts[1].spillDirectory = spillDirectory;
+	const char* names[] = {"heap", "spill file"};
+	Stats heap(img, opts[0]);
+
+	for (int o = 0; o < 2; o++)
+	{
+		long minor0, major0, minor1, major1, minor2, major2;
+		PageFaults(minor0, major0);
+		auto start = chrono::steady_clock::now();
+		Stats s(img, opts[o]);
+		double buildMs = ElapsedMs(start);
+		PageFaults(minor1, major1);
+		start = chrono::steady_clock::now();
+		ImgTree tree(img, opts[o]);
+		double treeMs = ElapsedMs(start);
+		PageFaults(minor2, major2);
+
+		cout << names[o] << ":	Stats " << buildMs << " ms (" << minor1 - minor0 << " minor / " << major1 - major0
+			 << " major faults),	ImgTree " << treeMs << " ms (" << minor2 - minor1 << " minor / " << major2 - major1
+			 << " major faults),	identical to heap: " << (SameTables(heap, s) ? "yes" : "NO") << endl;
+	}
+
+	cout << "Leaving BenchStatsSpill...\n"
+		 << endl;
+}
+
+/**
+ *  Times an ImgTree build that has to build and save its Stats tables against one that maps
+ *  them from the cache file the first one saved.
+ */
+void BenchStatsCache(const PNG& img, const string& cacheDirectory)
+{
+	cout << "Entered BenchStatsCache..." << endl;
+
+	StatsOptions opts;
+	opts.cacheDirectory = cacheDirectory;
+	string cachefile = cacheDirectory + "/" + Stats::CacheFileName(img.computeHash(), img.width(), img.height(), opts.layout);
+	remove(cachefile.c_str());
+
+	auto start = chrono::steady_clock::now();
+	Stats built(img, opts);
+	double buildMs = ElapsedMs(start);
+	start = chrono::steady_clock::now();
+	Stats loaded(img, opts);
+	double loadMs = ElapsedMs(start);
+	cout << "Stats:	built and saved in " << buildMs << " ms,	loaded in " << loadMs << " ms (from cache: "
+		 << (loaded.cached ? "yes" : "NO") << "),	identical: " << (SameTables(built, loaded) ? "yes" : "NO") << endl;
+
+	start = chrono::steady_clock::now();
+	ImgTree tree(img, opts);
+	double treeMs = ElapsedMs(start);
+	start = chrono::steady_clock::now();
+	ImgTree uncached(img);
+	double uncachedMs = ElapsedMs(start);
+	cout << "ImgTree:	" << uncachedMs << " ms without the cache,	" << treeMs << " ms with it" << endl;
+	remove(cachefile.c_str());
+
+	cout << "Leaving BenchStatsCache...\n"
+		 << endl;
+}
+
+/**
+ *  Times Stats::Update for a 32x32 patch at the centre and at the top left of the image against
+ *  rebuilding the whole Stats, for the planar and blocked layouts.
+ */
+void BenchStatsUpdate(const PNG& img)
+{
+	cout << "Entered BenchStatsUpdate..." << endl;
+
+	unsigned int w = img.width();
+	unsigned int h = img.height();
+	PNG patch(min(32u, w), min(32u, h));
+	for (unsigned int x = 0; x < patch.width(); x++)
+	{
+		for (unsigned int y = 0; y < patch.height(); y++)
+			*patch.getPixel(x, y) = RGBAPixel(x * 8, y * 8, 128);
+	}
+	const unsigned int upr[] = {(h - patch.height()) / 2, 0};
+	const unsigned int lft[] = {(w - patch.width()) / 2, 0};
+	const char* places[] = {"centre", "top left"};
+
+	StatsOptions layouts[2];
+	layouts[0].layout = StatsLayout::Planar;
+	layouts[1].layout = StatsLayout::Blocked;
+	const char* names[] = {"planar", "blocked"};
+	unsigned int threads = max(1u, thread::hardware_concurrency());
+
+	for (int l = 0; l < 2; l++)
+	{
+		auto start = chrono::steady_clock::now();
+		Stats s(img, layouts[l]);
+		double buildMs = ElapsedMs(start);
+
+		cout << names[l] << ":	rebuild " << buildMs << " ms";
+		for (int p = 0; p < 2; p++)
+		{
+			start = chrono::steady_clock::now();
+			s.Update(patch, upr[p], lft[p]);
+			double serialMs = ElapsedMs(start);
+			start = chrono::steady_clock::now();
+			s.Update(patch, upr[p], lft[p], threads);
+			double threadedMs = ElapsedMs(start);
+			cout << ",	update at " << places[p] << " " << serialMs << " ms (" << threadedMs << " ms on " << threads
+				 << " threads)";
+		}
+		cout << endl;
+	}
+
+	cout << "Leaving BenchStatsUpdate...\n"
+		 << endl;
+}
+
+/**
+ *  Builds an ImgTree from the file at path by way of a PNG, and straight from lodepng's RGBA8 output,
+ *  comparing time and the size of the pixel data each route holds while the tree is built.
+ */
+void BenchStatsDecode(const string& path)
+{
+	cout << "Entered BenchStatsDecode..." << endl;
+
+	auto start = chrono::steady_clock::now();
+	PNG img;
+	img.readFromFile(path);
+	ImgTree viaPNG(img);
+	double pngMs = ElapsedMs(start);
+	size_t pngBytes = sizeof(RGBAPixel) * img.width() * img.height();
+
+	start = chrono::steady_clock::now();
+	vector<unsigned char> rgba;
+	unsigned int w, h;
+	lodepng::decode(rgba, w, h, path);
+	ImgTree direct(rgba.data(), w, h);
+	double directMs = ElapsedMs(start);
+
+	cout << "via PNG:	" << pngMs << " ms,	" << pngBytes << " bytes of pixels" << endl;
+	cout << "from decoder:	" << directMs << " ms,	" << rgba.size() << " bytes of pixels,	identical tree: "
+		 << (viaPNG.Render(1) == direct.Render(1) ? "yes" : "NO") << endl;
+
+	cout << "Leaving BenchStatsDecode...\n"
+		 << endl;
+}
+
+/**
+ *  Scores every vertical cut of each full-width band of 1..16 rows, and every horizontal cut of each
+ *  full-height strip, with two GetSumSqDev calls per candidate and with one GetSplitScores call per
+ *  rectangle, for each layout, then times a whole ImgTree build.
+ */
+void BenchSplitScores(const PNG& img)
+{
+	cout << "Entered BenchSplitScores..." << endl;
+
+	StatsOptions layouts[3];
+	layouts[0].layout = StatsLayout::Planar;
+	layouts[1].layout = StatsLayout::Interleaved;
+	layouts[2].layout = StatsLayout::Blocked;
+	const char* names[] = {"planar", "interleaved", "blocked"};
+	unsigned int w = img.width();
+	unsigned int h = img.height();
+
+	for (int l = 0; l < 3; l++)
+	{
+		Stats s(img, layouts[l]);
+		double pairSum = 0.0;
+		auto start = chrono::steady_clock::now();
+		for (unsigned int band = 1; band <= 16; band++)
+		{
+			for (unsigned int upr = 0; upr + band <= h; upr += band)
+			{
+				for (unsigned int i = 0; i + 1 < w; i++)
+					pairSum += s.GetSumSqDev(upr, 0, upr + band - 1, i) + s.GetSumSqDev(upr, i + 1, upr + band - 1, w - 1);
+			}
+			for (unsigned int lft = 0; lft + band <= w; lft += band)
+			{
+				for (unsigned int i = 0; i + 1 < h; i++)
+					pairSum += s.GetSumSqDev(0, lft, i, lft + band - 1) + s.GetSumSqDev(i + 1, lft, h - 1, lft + band - 1);
+			}
+		}
+		double pairMs = ElapsedMs(start);
+
+		double batchSum = 0.0;
+		vector<double> scores;
+		start = chrono::steady_clock::now();
+		for (unsigned int band = 1; band <= 16; band++)
+		{
+			for (unsigned int upr = 0; upr + band <= h; upr += band)
+			{
+				s.GetSplitScores(upr, 0, upr + band - 1, w - 1, true, scores);
+				for (double score : scores)
+					batchSum += score;
+			}
+			for (unsigned int lft = 0; lft + band <= w; lft += band)
+			{
+				s.GetSplitScores(0, lft, h - 1, lft + band - 1, false, scores);
+				for (double score : scores)
+					batchSum += score;
+			}
+		}
+		double batchMs = ElapsedMs(start);
+
+		cout << names[l] << ":\tGetSumSqDev pairs " << pairMs << " ms,\tGetSplitScores " << batchMs
+			 << " ms,\tsame scores: " << (pairSum == batchSum ? "yes" : "NO") << endl;
+	}
+
+	auto start = chrono::steady_clock::now();
+	ImgTree tree(img);
+	cout << "ImgTree build: " << ElapsedMs(start) << " ms" << endl;
+
+	cout << "Leaving BenchSplitScores...\n"
+		 << endl;
+}
+
+/**
+ *  Times each split sweep kernel the CPU supports over the projections of every full-width band of
+ *  1..16 rows and every full-height strip of 1..16 columns, gathered beforehand, and checks that
+ *  all of them choose the scalar kernel's cuts. Then times a whole ImgTree build with the kernel
+ *  selected at runtime.
+ */
+void BenchSplitSweepKernels(const PNG& img)
+{
+	cout << "Entered BenchSplitSweepKernels..." << endl;
+	cout << "Kernel selected at runtime: " << SimdLevelName(BestSimdLevel()) << endl;
+
+	unsigned int w = img.width();
+	unsigned int h = img.height();
+	Stats s(img);
+	struct Projection
+	{
+		vector<uint64_t> strip;
+		unsigned int count, span;
+	};
+	vector<Projection> projections;
+	for (unsigned int band = 1; band <= 16; band++)
+	{
+		for (unsigned int upr = 0; upr + band <= h; upr += band)
+		{
+			projections.push_back({vector<uint64_t>(), w - 1, band});
+			s.GatherSplitStrip(upr, 0, upr + band - 1, w - 1, true, projections.back().strip);
+		}
+		for (unsigned int lft = 0; lft + band <= w; lft += band)
+		{
+			projections.push_back({vector<uint64_t>(), h - 1, band});
+			s.GatherSplitStrip(0, lft, h - 1, lft + band - 1, false, projections.back().strip);
+		}
+	}
+
+	const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::AVX2};
+	vector<unsigned int> expected;
+	for (SimdLevel level : levels)
+	{
+		SplitSweepKernel sweep = SplitSweepKernelFor(level);
+		if (sweep == nullptr)
+		{
+			cout << SimdLevelName(level) << ":\tnot supported on this CPU" << endl;
+			continue;
+		}
+
+		vector<unsigned int> choices;
+		unsigned long candidates = 0;
+		auto start = chrono::steady_clock::now();
+		for (const Projection& p : projections)
+		{
+			choices.push_back(sweep(p.strip.data(), p.count, p.span, s.opaque, 0, (int)(p.count + 1) / 2));
+			candidates += p.count;
+		}
+		double ms = ElapsedMs(start);
+		if (expected.empty())
+			expected = choices;
+
+		cout << SimdLevelName(level) << ":\t" << ms * 1e6 / candidates << " ns/candidate,\tmatches scalar: "
+			 << (choices == expected ? "yes" : "NO") << endl;
+	}
+
+	auto start = chrono::steady_clock::now();
+	ImgTree tree(img);
+	cout << "ImgTree build: " << ElapsedMs(start) << " ms" << endl;
+
+	cout << "Leaving BenchSplitSweepKernels...\n"
+		 << endl;
+}
+
+/**
+ *  Times ImgTree construction, tables and tree, with 1, 2, 4, ... threads up to the hardware thread
+ *  count, and checks that every threaded tree renders and counts the same as the serial one.
+ */
+void BenchImgTreeBuildThreads(const PNG& img)
+{
+	cout << "Entered BenchImgTreeBuildThreads..." << endl;
+
+	unsigned int maxThreads = max(1u, thread::hardware_concurrency());
+	ImgTree serial(img);
+	PNG serialRender = serial.Render(1);
+
+	for (unsigned int threads = 1; ; threads *= 2)
+	{
+		threads = min(threads, maxThreads);
+		StatsOptions opts;
+		opts.threads = threads;
+		auto start = chrono::steady_clock::now();
+		ImgTree tree(img, opts);
+		double buildMs = ElapsedMs(start);
+
+		cout << threads << " thread(s):\tbuild " << buildMs << " ms,\tidentical to serial: "
+			 << (tree.CountLeaves() == serial.CountLeaves() && tree.Render(1) == serialRender ? "yes" : "NO") << endl;
+		if (threads == maxThreads)
+			break;
+	}
+
+	cout << "Leaving BenchImgTreeBuildThreads...\n"
+		 << endl;
+}
+
+/**
+ *  Times the whole-tree traversals, copy, leaf count, render and destruction, on the tree of the
+ *  image and on the tree of a 1x100000 strip, whose nodes are all one pixel wide.
+ */
+void BenchImgTreeTraversals(const PNG& img)
+{
+	cout << "Entered BenchImgTreeTraversals..." << endl;
+
+	PNG strip(1, 100000);
+	for (unsigned int y = 0; y < strip.height(); y++)
+		*strip.getPixel(0, y) = RGBAPixel(y * 256 / strip.height(), y % 256, 128);
+	const PNG* images[] = {&img, &strip};
+
+	for (const PNG* image : images)
+	{
+		ImgTree tree(*image);
+		auto start = chrono::steady_clock::now();
+		ImgTree* copied = new ImgTree(tree);
+		double copyMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		unsigned int leaves = copied->CountLeaves();
+		double countMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		PNG rendered = copied->Render(1);
+		double renderMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		delete copied;
+		double clearMs = ElapsedMs(start);
+
+		cout << image->width() << "x" << image->height() << " (" << leaves << " leaves):\tcopy " << copyMs << " ms,\tcount "
+			 << countMs << " ms,\trender " << renderMs << " ms,\tclear " << clearMs << " ms" << endl;
+	}
+
+	cout << "Leaving BenchImgTreeTraversals...\n"
+		 << endl;
+}
+
+/**
+ *  Compares building the whole tree and pruning it with building the pruned tree directly:
+ *  time, and the most nodes each holds at once (every node of a binary tree with n leaves is
+ *  one of its 2n - 1, so the whole tree peaks at 2 * pixels - 1).
+ */
+void BenchImgTreeBuildPruned(const PNG& img)
+{
+	cout << "Entered BenchImgTreeBuildPruned..." << endl;
+
+	const double settings[][2] = {{99, 0.1}, {95, 0.02}, {85, 0.02}};
+	unsigned long fullNodes = 2ul * img.width() * img.height() - 1;
+	for (const double* setting : settings)
+	{
+		auto start = chrono::steady_clock::now();
+		ImgTree pruned(img);
+		pruned.Prune(setting[0], setting[1]);
+		double pruneMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		ImgTree built(img, setting[0], setting[1]);
+		double builtMs = ElapsedMs(start);
+
+		unsigned long builtNodes = 2ul * built.CountLeaves() - 1;
+		cout << "pct " << setting[0] << ", tol " << setting[1] << ":\tbuild+prune " << pruneMs << " ms, "
+			 << fullNodes << " nodes;\tpruned build " << builtMs << " ms, " << builtNodes << " nodes;\tsame leaves: "
+			 << (built.CountLeaves() == pruned.CountLeaves() && built.Render(1) == pruned.Render(1) ? "yes" : "NO") << endl;
+	}
+
+	cout << "Leaving BenchImgTreeBuildPruned...\n"
+		 << endl;
+}
+
+/**
+ *  Compares building the whole tree with growing it best-first to a leaf budget: time, nodes
+ *  held, and the mean squared error of the rendered image against the original.
+ */
+void BenchImgTreeLeafBudget(const PNG& img)
+{
+	cout << "Entered BenchImgTreeLeafBudget..." << endl;
+
+	auto start = chrono::steady_clock::now();
+	ImgTree full(img);
+	double fullMs = ElapsedMs(start);
+	unsigned long pixels = (unsigned long)img.width() * img.height();
+	cout << "whole tree:\t" << fullMs << " ms,\t" << 2 * pixels - 1 << " nodes" << endl;
+
+	const unsigned int budgets[] = {1000, 10000, 50000};
+	for (unsigned int budget : budgets)
+	{
+		start = chrono::steady_clock::now();
+		ImgTree budgeted(img, LeafBudget(budget));
+		double budgetMs = ElapsedMs(start);
+		cout << budget << " leaves:\t" << budgetMs << " ms,\t" << 2ul * budgeted.CountLeaves() - 1
+			 << " nodes,\tMSE " << MeanSquaredError(img, budgeted.Render(1)) << endl;
+	}
+
+	cout << "Leaving BenchImgTreeLeafBudget...\n"
+		 << endl;
+}
+
+/**
+ *  Compares exhaustive and coarse-to-fine split search: build time, then the quality each tree
+ *  gives once reduced, as leaves and mean squared error after Prune and at a leaf budget.
+ *  Unreduced, both trees render the image exactly. Then the same on a 16384x64 image grown to
+ *  1000 leaves, whose splits are all near the root and have thousands of candidates.
+ */
+void BenchImgTreeApproximateSplits(const PNG& img)
+{
+	cout << "Entered BenchImgTreeApproximateSplits..." << endl;
+
+	const char* names[] = {"exhaustive", "coarse-to-fine"};
+	for (int i = 0; i < 2; i++)
+	{
+		ImgTreeOptions opts;
+		opts.approximateSplits = i == 1;
+		auto start = chrono::steady_clock::now();
+		ImgTree tree(img, StatsOptions(), opts);
+		double buildMs = ElapsedMs(start);
+		tree.Prune(95, 0.02);
+		ImgTree budgeted(img, LeafBudget(10000), StatsOptions(), opts);
+
+		cout << names[i] << ":\tbuild " << buildMs << " ms,\tPrune(95, 0.02) " << tree.CountLeaves() << " leaves, MSE "
+			 << MeanSquaredError(img, tree.Render(1)) << ",\t10000 leaves MSE " << MeanSquaredError(img, budgeted.Render(1)) << endl;
+	}
+
+	// near the root of a wide image, where each split has thousands of candidates
+	PNG wide(16384, 64);
+	for (unsigned int y = 0; y < wide.height(); y++)
+		for (unsigned int x = 0; x < wide.width(); x++)
+			*wide.getPixel(x, y) = RGBAPixel(x * 256 / wide.width(), (x * 7 + y * 13) % 256, (x / 97) % 2 * 200);
+	for (int i = 0; i < 2; i++)
+	{
+		ImgTreeOptions opts;
+		opts.approximateSplits = i == 1;
+		auto start = chrono::steady_clock::now();
+		Stats s(wide);
+		double tablesMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		ImgTree budgeted(wide, LeafBudget(1000), StatsOptions(), opts);
+		double buildMs = ElapsedMs(start);
+		cout << names[i] << ", 16384x64 to 1000 leaves:\tbuild " << buildMs << " ms (tables alone "
+			 << tablesMs << " ms),\tMSE "
+			 << MeanSquaredError(wide, budgeted.Render(1)) << endl;
+	}
+
+	cout << "Leaving BenchImgTreeApproximateSplits...\n"
+		 << endl;
+}
+
+/**
+ *  Times building a tree that searches its splits and saves them, rebuilding it with only the
+ *  Stats tables cached, and rebuilding it replaying the saved splits as well.
+ */
+void BenchImgTreeSplitCache(const PNG& img, const string& cacheDirectory)
+{
+	cout << "Entered BenchImgTreeSplitCache..." << endl;
+
+	StatsOptions opts;
+	opts.cacheDirectory = cacheDirectory;
+	ImgTreeOptions splitCache;
+	splitCache.cacheSplits = true;
+	string cachefile = cacheDirectory + "/" + Stats::CacheFileName(img.computeHash(), img.width(), img.height(), opts.layout);
+	string logfile = cacheDirectory + "/" + ImgTree::SplitLogFileName(img.computeHash(), img.width(), img.height(), false, false);
+	remove(cachefile.c_str());
+	remove(logfile.c_str());
+
+	auto start = chrono::steady_clock::now();
+	ImgTree recorded(img, opts, splitCache);
+	double recordMs = ElapsedMs(start);
+	start = chrono::steady_clock::now();
+	ImgTree searched(img, opts);
+	double searchMs = ElapsedMs(start);
+	start = chrono::steady_clock::now();
+	ImgTree replayed(img, opts, splitCache);
+	double replayMs = ElapsedMs(start);
+
+	cout << "searched and saved " << recordMs << " ms,\tsearched with cached tables " << searchMs
+		 << " ms,\treplayed " << replayMs << " ms,\tidentical: "
+		 << (replayed.CountLeaves() == recorded.CountLeaves() && replayed.Render(1) == recorded.Render(1) ? "yes" : "NO") << endl;
+	remove(cachefile.c_str());
+	remove(logfile.c_str());
+
+	cout << "Leaving BenchImgTreeSplitCache...\n"
+		 << endl;
+}
+
+/**
+ *  Compares choosing each split's orientation by aspect ratio with searching both orientations:
+ *  build time, then leaves after Prune at the same settings.
+ */
+void BenchImgTreeBothOrientations(const PNG& img)
+{
+	cout << "Entered BenchImgTreeBothOrientations..." << endl;
+
+	ImgTreeOptions both;
+	both.bothOrientations = true;
+	auto start = chrono::steady_clock::now();
+	ImgTree byAspect(img);
+	double aspectMs = ElapsedMs(start);
+	start = chrono::steady_clock::now();
+	ImgTree byScore(img, StatsOptions(), both);
+	double scoreMs = ElapsedMs(start);
+	cout << "build:\tby aspect ratio " << aspectMs << " ms,\tboth orientations " << scoreMs << " ms" << endl;
+
+	const double settings[][2] = {{99, 0.1}, {95, 0.02}, {85, 0.02}};
+	for (const double* setting : settings)
+	{
+		ImgTree aspectPruned(byAspect);
+		aspectPruned.Prune(setting[0], setting[1]);
+		ImgTree scorePruned(byScore);
+		scorePruned.Prune(setting[0], setting[1]);
+		cout << "pct " << setting[0] << ", tol " << setting[1] << ":\tby aspect ratio " << aspectPruned.CountLeaves()
+			 << " leaves, MSE " << MeanSquaredError(img, aspectPruned.Render(1)) << ",\tboth orientations "
+			 << scorePruned.CountLeaves() << " leaves, MSE " << MeanSquaredError(img, scorePruned.Render(1)) << endl;
+	}
+
+	cout << "Leaving BenchImgTreeBothOrientations...\n"
+		 << endl;
+}
+
+/**
+ *  Compares binary and quad trees of the image: build, copy, leaf count, render and Prune times,
+ *  then leaves and mean squared error after Prune at the same settings.
+ */
+void BenchImgTreeQuadSplits(const PNG& img)
+{
+	cout << "Entered BenchImgTreeQuadSplits..." << endl;
+
+	const char* names[] = {"binary", "quad"};
+	const double settings[][2] = {{99, 0.1}, {95, 0.02}, {85, 0.02}};
+	for (int i = 0; i < 2; i++)
+	{
+		ImgTreeOptions opts;
+		opts.quadSplits = i == 1;
+		auto start = chrono::steady_clock::now();
+		ImgTree tree(img, StatsOptions(), opts);
+		double buildMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		ImgTree copied(tree);
+		double copyMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		unsigned int leaves = tree.CountLeaves();
+		double countMs = ElapsedMs(start);
+		start = chrono::steady_clock::now();
+		PNG rendered = tree.Render(1);
+		double renderMs = ElapsedMs(start);
+		cout << names[i] << ":\tbuild " << buildMs << " ms,\tcopy " << copyMs << " ms,\tcount " << countMs << " ms ("
+			 << leaves << " leaves),\trender " << renderMs << " ms" << endl;
+
+		for (const double* setting : settings)
+		{
+			ImgTree pruned(tree);
+			start = chrono::steady_clock::now();
+			pruned.Prune(setting[0], setting[1]);
+			double pruneMs = ElapsedMs(start);
+			cout << "\tPrune(" << setting[0] << ", " << setting[1] << ") " << pruneMs << " ms:\t" << pruned.CountLeaves()
+				 << " leaves, MSE " << MeanSquaredError(img, pruned.Render(1)) << endl;
+		}
+	}
+
+	cout << "Leaving BenchImgTreeQuadSplits...\n"
+		 << endl;
+}
+
+/**
+ *  Milliseconds elapsed since start
+ */
+double ElapsedMs(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ *  True if every summed-area entry of s1 and s2 holds exactly the same eight sums
+ */
+bool SameTables(const Stats& s1, const Stats& s2)
+{
+	if (s1.width != s2.width || s1.height != s2.height)
+		return false;
+	for (unsigned int y = 0; y < s1.height; y++)
+	{
+		for (unsigned int x = 0; x < s1.width; x++)
+		{
+			SumRecord c1 = s1.GetAllSums(0, 0, y, x);
+			SumRecord c2 = s2.GetAllSums(0, 0, y, x);
+			if (c1.r != c2.r || c1.g != c2.g || c1.b != c2.b || c1.a != c2.a ||
+				c1.sqR != c2.sqR || c1.sqG != c2.sqG || c1.sqB != c2.sqB || c1.sqA != c2.sqA)
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+ *  Page faults taken by this process so far: minor ones were served from memory, major ones needed I/O
+ */
+void PageFaults(long& minor, long& major)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	minor = usage.ru_minflt;
+	major = usage.ru_majflt;
+}
+
+/**
+ *  Mean squared difference per colour channel between img and a rendering of it
+ */
+double MeanSquaredError(const PNG& img, const PNG& rendered)
+{
+	double sum = 0;
+	for (unsigned int y = 0; y < img.height(); y++)
+	{
+		for (unsigned int x = 0; x < img.width(); x++)
+		{
+			const RGBAPixel* p = img.getPixel(x, y);
+			const RGBAPixel* q = rendered.getPixel(x, y);
+			sum += (p->r - q->r) * (p->r - q->r) + (p->g - q->g) * (p->g - q->g) + (p->b - q->b) * (p->b - q->b);
+		}
+	}
+	return sum / (3.0 * img.width() * img.height());
+}
\ No newline at end of file
@@ -46,6 +46,15 @@ namespace cs221util {
 
   double RGBAPixel::dist(const RGBAPixel& other) const {
     // original pam.h assumes RGB values range from 0 to 1.
+
+    if (this->a == 1.0 && other.a == 1.0) {
+      // both opaque: delta_a is 0, so blending on white equals blending on black
+      // and only the three color differences remain
+      double dr = (double)this->r / 255.0 - (double)other.r / 255.0;
+      double dg = (double)this->g / 255.0 - (double)other.g / 255.0;
+      double db = (double)this->b / 255.0 - (double)other.b / 255.0;
+      return dr * dr + dg * dg + db * db;
+    }
     
     // also pre-multiply alpha
     double dbl_r_this = (double)this->r / 255.0 * this->a;
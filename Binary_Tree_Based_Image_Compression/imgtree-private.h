@@ -21,5 +21,41 @@
     int CountLeavesR(ImgTreeNode *subTree) const;
     ImgTreeNode* Copy(ImgTreeNode* const &originSubTree);
     void Clear(ImgTreeNode *subTree);
-    void PruneLeavesR(double pct, double tol, ImgTreeNode* root);
-    int CountTolerantLeavesR(double tol, ImgTreeNode *subTree, RGBAPixel avg);
\ No newline at end of file
+    void PruneLeavesR(double pct, double tol, ImgTreeNode*& subTree);
+    int CountTolerantLeavesR(double tol, ImgTreeNode *subTree, RGBAPixel avg);
+    ImgTreeNode* BuildNode(Stats& s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+      size_t index, const function<bool(const ImgTreeNode&)>& keepWhole);
+    ImgTreeNode* BuildTree(Stats& s, unsigned int threads,
+      const function<bool(const ImgTreeNode&)>& keepWhole = nullptr);
+    void BuildNodeTask(TaskPool& pool, Stats& s, unsigned int upr, unsigned int lft, unsigned int lwr,
+      unsigned int rt, size_t index, ImgTreeNode** slot, const function<bool(const ImgTreeNode&)>& keepWhole);
+    // stack capacity for a depth-first traversal of the given rectangle's subtree
+    size_t StackBound(unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt) const;
+    static const unsigned long ParallelBuildCutoff = 16384; // smallest rectangle, in pixels, built as parallel tasks
+    unsigned int FindApproximateSplit(Stats& s, unsigned int upr, unsigned int lft,
+      unsigned int lwr, unsigned int rt, bool vertical);
+    bool approximateSplits; // search splits coarse-to-fine while building, see ImgTreeOptions::approximateSplits
+    bool bothOrientations; // search both orientations of every split while building, see ImgTreeOptions::bothOrientations
+    bool quadSplits; // split nodes four ways while building, see ImgTreeOptions::quadSplits
+    bool FindQuadSplit(Stats& s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+      unsigned int& row, unsigned int& column);
+    static double SplitScore(Stats& s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+      bool vertical, unsigned int coordinate);
+    static const unsigned int ApproximateSplitMin = 64; // fewest candidates searched coarse-to-fine
+    static const unsigned int ApproximateSplitRefine = 3; // best coarse candidates refined exhaustively
+    unsigned int ChooseSplit(Stats& s, size_t index, unsigned int upr, unsigned int lft,
+      unsigned int lwr, unsigned int rt, bool& vertical);
+    string OpenSplitLog(const Stats& s, const StatsOptions& options, const ImgTreeOptions& treeOptions, bool record,
+      vector<uint32_t>& log);
+    void CloseSplitLog(const string& path, size_t imageHash, const vector<uint32_t>& log);
+    bool LoadSplitLog(const string& path, size_t imageHash, vector<uint32_t>& log) const;
+    bool SaveSplitLog(const string& path, size_t imageHash, const vector<uint32_t>& log) const;
+    // during construction: split of every node of the whole tree of more than one pixel, in
+    // the order BuildNode visits them, used while replaySplits or recordSplits is set (a one-pixel
+    // image has no entries, so the pointer may be null); see ImgTreeOptions::cacheSplits. The node with index i
+    // has its A child at i + 1 and its B child at i + (pixels under A), whatever the builder.
+    // Each split is its coordinate, ORed with SplitLogVertical for a vertical cut.
+    uint32_t* splitLog;
+    static const uint32_t SplitLogVertical = 0x80000000;
+    bool replaySplits; // during construction: splitLog holds the splits of an earlier build, to be reused
+    bool recordSplits; // during construction: this build's splits are written to splitLog, to be saved
\ No newline at end of file
@@ -7,6 +7,17 @@
  */
 
 #include "imgtree.h"
+#include "stats-simd.h"
+#include "taskpool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <sstream>
 // not necessary to include imgtree-private.h since it is already included in imgtree.h
 
 /**
@@ -15,6 +26,12 @@
 ImgTree::ImgTree()
 {
     root = nullptr;
+    approximateSplits = false;
+    bothOrientations = false;
+    quadSplits = false;
+    splitLog = nullptr;
+    replaySplits = false;
+    recordSplits = false;
 }
 
 /**
@@ -51,13 +68,68 @@ ImgTree::ImgTree()
  *     most evenly splits the rectangular area will be chosen.
  *  4. In the even more unlikely even that two candidates produce the same score and produce
  *     the same minimal area difference, the one with the smaller coordinate will be chosen.
+ *
+ *  @param img - input image
+ *  @param options - how the Stats tables used during construction are built and stored,
+ *                   e.g. in a spill file for images whose tables do not fit in memory
+ *  @param treeOptions - how the tree chooses its splits
  */
-ImgTree::ImgTree(const PNG &img)
+ImgTree::ImgTree(const PNG &img, const StatsOptions &options, const ImgTreeOptions &treeOptions)
+    : ImgTree(img, 0, 0, img.height() - 1, img.width() - 1, options, treeOptions)
 {
-    Stats s(img);
-    root = BuildNode(s, 0, 0, img.height() - 1, img.width() - 1);
-    imgheight = img.height();
-    imgwidth = img.width();
+}
+
+/**
+ *  Region-of-interest constructor creates a tree from the rectangle of img bounded by upper, left,
+ *  lower and right, exactly as the constructor above would from an image holding only that rectangle.
+ *  Only the rectangle's Stats tables are built, so the cost is proportional to its area.
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param img - input image
+ *  @param upper - y-coordinate of the upper edge of the region
+ *  @param left - x-coordinate of the left side of the region
+ *  @param lower - y-coordinate of the lower edge of the region
+ *  @param right - x-coordinate of the right side of the region
+ *  @param options - how the Stats tables used during construction are built and stored
+ *  @param treeOptions - how the tree chooses its splits
+ */
+ImgTree::ImgTree(const PNG &img, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                 const StatsOptions &options, const ImgTreeOptions &treeOptions)
+{
+    Stats s(img, upper, left, lower, right, options);
+    imgheight = lower - upper + 1;
+    imgwidth = right - left + 1;
+    approximateSplits = treeOptions.approximateSplits;
+    bothOrientations = treeOptions.bothOrientations;
+    quadSplits = treeOptions.quadSplits;
+    vector<uint32_t> log;
+    string logPath = OpenSplitLog(s, options, treeOptions, true, log);
+    root = BuildTree(s, options.threads);
+    CloseSplitLog(logPath, s.imageHash, log);
+}
+
+/**
+ *  Decoder constructor creates a tree straight from RGBA8 scanlines, as lodepng::decode
+ *  produces them, without an intermediate PNG. The tree is the one the first constructor
+ *  would build from the decoded PNG.
+ *  @param rgba - width * height pixels, row-major, 4 bytes each in r, g, b, a order
+ *  @param width - image width in pixels
+ *  @param height - image height in pixels
+ *  @param options - how the Stats tables used during construction are built and stored
+ *  @param treeOptions - how the tree chooses its splits
+ */
+ImgTree::ImgTree(const unsigned char *rgba, unsigned int width, unsigned int height, const StatsOptions &options,
+                 const ImgTreeOptions &treeOptions)
+{
+    Stats s(rgba, width, height, options);
+    imgheight = height;
+    imgwidth = width;
+    approximateSplits = treeOptions.approximateSplits;
+    bothOrientations = treeOptions.bothOrientations;
+    quadSplits = treeOptions.quadSplits;
+    vector<uint32_t> log;
+    string logPath = OpenSplitLog(s, options, treeOptions, true, log);
+    root = BuildTree(s, options.threads);
+    CloseSplitLog(logPath, s.imageHash, log);
 }
 
 /**
@@ -81,11 +153,17 @@ void ImgTree::Copy(const ImgTree &other)
 {
     imgwidth = other.imgwidth;
     imgheight = other.imgheight;
+    approximateSplits = other.approximateSplits;
+    bothOrientations = other.bothOrientations;
+    quadSplits = other.quadSplits;
+    splitLog = nullptr;
+    replaySplits = false;
+    recordSplits = false;
     root = Copy(other.root);
 }
 
 /**
- *  Recursive helper function for initial construction of the tree. Constructs a single
+ *  Helper function for initial construction of the tree. Constructs a single
  *  node according to supplied Stats and the requirements specified by the constructor
  *  documentation, and returns a pointer to the completed node.
  *  @param s - populated Stats object for computing this node's attributes
@@ -97,49 +175,316 @@ void ImgTree::Copy(const ImgTree &other)
  */
 ImgTreeNode *ImgTree::BuildNode(Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt)
 {
-    // Calculate the average color for the current region
-    RGBAPixel avg = s.GetAvg(upr, lft, lwr, rt);
+    return BuildNode(s, upr, lft, lwr, rt, 0, nullptr);
+}
 
-    // Create the new node with the calculated average color
-    ImgTreeNode *node = new ImgTreeNode(upr, lft, lwr, rt, avg);
+/**
+ *  BuildNode that also stops descending wherever keepWhole says a node should stay a leaf
+ *  @param index - the node's index in splitLog
+ *  @param keepWhole - called on each node of more than one pixel once its average is set;
+ *                     if empty, every node is split down to single pixels
+ */
+ImgTreeNode *ImgTree::BuildNode(Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+                                size_t index, const function<bool(const ImgTreeNode &)> &keepWhole)
+{
+    // Nodes still to build, each with the child pointer it goes into. The stack is worked
+    // depth-first, A before B, like the recursion it replaces, and holds the pending siblings
+    // of each level; every split shrinks the width or height, so the depth is bounded by both.
+    struct Pending
+    {
+        unsigned int upr, lft, lwr, rt;
+        size_t index;
+        ImgTreeNode **slot;
+    };
+    ImgTreeNode *top = nullptr;
+    vector<Pending> stack;
+    stack.reserve(StackBound(upr, lft, lwr, rt));
+    stack.push_back({upr, lft, lwr, rt, index, &top});
 
-    // Base case: if the region is a single pixel, return the node
-    if (upr == lwr && lft == rt)
+    while (!stack.empty())
     {
-        return node;
+        Pending p = stack.back();
+        stack.pop_back();
+
+        // Calculate the average color for the current region
+        RGBAPixel avg = s.GetAvg(p.upr, p.lft, p.lwr, p.rt);
+
+        // Base case: if the region is a single pixel, or is to be kept whole, the node is a leaf
+        if ((p.upr == p.lwr && p.lft == p.rt) ||
+            (keepWhole && keepWhole(ImgTreeNode(p.upr, p.lft, p.lwr, p.rt, avg))))
+        {
+            *p.slot = new ImgTreeNode(p.upr, p.lft, p.lwr, p.rt, avg);
+            continue;
+        }
+
+        // quad trees are not logged, so their nodes' indices do not matter
+        unsigned int row, column;
+        if (FindQuadSplit(s, p.upr, p.lft, p.lwr, p.rt, row, column))
+        {
+            ImgTreeQuadNode *quad = new ImgTreeQuadNode(p.upr, p.lft, p.lwr, p.rt, avg);
+            *p.slot = quad;
+            stack.push_back({row + 1, column + 1, p.lwr, p.rt, 0, &quad->D});
+            stack.push_back({row + 1, p.lft, p.lwr, column, 0, &quad->C});
+            stack.push_back({p.upr, column + 1, row, p.rt, 0, &quad->B});
+            stack.push_back({p.upr, p.lft, row, column, 0, &quad->A});
+            continue;
+        }
+
+        ImgTreeNode *node = new ImgTreeNode(p.upr, p.lft, p.lwr, p.rt, avg);
+        *p.slot = node;
+
+        bool verticalSplit;
+        unsigned int splitCoordinate = ChooseSplit(s, p.index, p.upr, p.lft, p.lwr, p.rt, verticalSplit);
+
+        // B goes on the stack first so that A is built first
+        if (verticalSplit)
+        {
+            size_t indexB = p.index + (size_t)(p.lwr - p.upr + 1) * (splitCoordinate - p.lft + 1);
+            stack.push_back({p.upr, splitCoordinate + 1, p.lwr, p.rt, indexB, &node->B});
+            stack.push_back({p.upr, p.lft, p.lwr, splitCoordinate, p.index + 1, &node->A});
+        }
+        else
+        {
+            size_t indexB = p.index + (size_t)(splitCoordinate - p.upr + 1) * (p.rt - p.lft + 1);
+            stack.push_back({splitCoordinate + 1, p.lft, p.lwr, p.rt, indexB, &node->B});
+            stack.push_back({p.upr, p.lft, splitCoordinate, p.rt, p.index + 1, &node->A});
+        }
     }
 
-    // Determine the best split and create child nodes
-    unsigned int splitCoordinate;
-    bool verticalSplit;
+    return top;
+}
 
-    if ((rt - lft) >= (lwr - upr))
+/**
+ *  Pruning constructor creates the tree that the first constructor followed by Prune(pct, tol)
+ *  would leave, without ever allocating the nodes that Prune would delete: a node is kept as a
+ *  leaf as soon as at least pct (out of 100) of the pixels under it are within tol of its average.
+ *  The tables and the tree are built as options say, on options.threads threads.
+ *  Cost: the test compares pixels against each node's own average, so the children's counts
+ *  cannot be reused and every node above the pruned leaves scans its pixels again, O(pixels *
+ *  depth) in the worst case. A scan stops as soon as its outcome is settled, which keeps it short
+ *  for nodes far from either side of pct; no memory beyond the tables and the tree is used.
+ *  @pre pct is a valid value between 0 and 100
+ *  @param img - input image
+ *  @param pct - percentage (out of 100) of pixels that must be within the tolerance for a node to stay whole
+ *  @param tol - threshold color difference to qualify for pruning
+ *  @param options - how the Stats tables used during construction are built and stored
+ *  @param treeOptions - how the tree chooses its splits
+ */
+ImgTree::ImgTree(const PNG &img, double pct, double tol, const StatsOptions &options,
+                 const ImgTreeOptions &treeOptions)
+{
+    Stats s(img, options);
+    imgheight = img.height();
+    imgwidth = img.width();
+    approximateSplits = treeOptions.approximateSplits;
+    bothOrientations = treeOptions.bothOrientations;
+    quadSplits = treeOptions.quadSplits;
+
+    vector<uint32_t> log;
+    string logPath = OpenSplitLog(s, options, treeOptions, false, log);
+    root = BuildTree(s, options.threads, [&](const ImgTreeNode &node) {
+        // the same test as PruneLeavesR, on a subtree whose leaves are exactly the node's pixels,
+        // each with the colour s gives that single pixel
+        size_t totalLeaves = (size_t)(node.lower - node.upper + 1) * (node.right - node.left + 1);
+        auto passes = [&](size_t tolLeaves) { return (double)tolLeaves / (double)totalLeaves * 100.0 >= pct; };
+
+        // fewest tolerant leaves that pass, found with PruneLeavesR's own arithmetic
+        double estimate = pct / 100.0 * (double)totalLeaves;
+        size_t need = estimate <= 0.0 ? 0 : estimate >= (double)totalLeaves ? totalLeaves : (size_t)estimate;
+        while (need > 0 && passes(need - 1))
+        {
+            need--;
+        }
+        while (need <= totalLeaves && !passes(need))
+        {
+            need++;
+        }
+
+        size_t tolLeaves = 0;
+        size_t remaining = totalLeaves;
+        for (unsigned int y = node.upper; y <= node.lower; y++)
+        {
+            for (unsigned int x = node.left; x <= node.right; x++)
+            {
+                if (tolLeaves >= need)
+                {
+                    return true;
+                }
+                if (tolLeaves + remaining < need)
+                {
+                    return false;
+                }
+                if (node.avg.dist(s.GetAvg(y, x, y, x)) <= tol)
+                {
+                    tolLeaves++;
+                }
+                remaining--;
+            }
+        }
+        return tolLeaves >= need;
+    });
+    CloseSplitLog(logPath, s.imageHash, log);
+}
+
+/**
+ *  Leaf-budget constructor grows the tree best-first: starting from the root, it repeatedly splits
+ *  the leaf whose split removes the most sum squared deviation, until the tree has budget.leaves leaves
+ *  or every leaf is a single pixel. Each split is the one the first constructor makes for the same
+ *  rectangle, so the result is the top of that tree. Nodes and queued leaves are O(budget.leaves).
+ *  @param img - input image
+ *  @param budget - most leaves the tree may have, as LeafBudget(n)
+ *  @param options - how the Stats tables used during construction are built and stored
+ *  @param treeOptions - how the tree chooses its splits
+ */
+ImgTree::ImgTree(const PNG &img, LeafBudget budget, const StatsOptions &options,
+                 const ImgTreeOptions &treeOptions)
+{
+    Stats s(img, options);
+    imgheight = img.height();
+    imgwidth = img.width();
+    approximateSplits = treeOptions.approximateSplits;
+    bothOrientations = treeOptions.bothOrientations;
+    quadSplits = treeOptions.quadSplits;
+
+    // a leaf waiting to be split, with the split the first constructor would make
+    struct Candidate
     {
-        // Vertical split
-        verticalSplit = true;
-        splitCoordinate = FindBestSplit(s, upr, lft, lwr, rt, verticalSplit);
-    }
-    else
+        double gain;        // sum squared deviation removed by the split
+        unsigned long rank; // order queued in, so equal gains split first-come first-served
+        ImgTreeNode *node;
+        size_t index; // the node's index in splitLog
+        bool vertical;
+        unsigned int coordinate;
+    };
+    auto lessUrgent = [](const Candidate &c1, const Candidate &c2) {
+        return c1.gain < c2.gain || (c1.gain == c2.gain && c1.rank > c2.rank);
+    };
+    priority_queue<Candidate, vector<Candidate>, decltype(lessUrgent)> queue(lessUrgent);
+    unsigned long queued = 0;
+
+    vector<uint32_t> log;
+    string logPath = OpenSplitLog(s, options, treeOptions, false, log);
+    auto enqueue = [&](ImgTreeNode *node, size_t index) {
+        if (node->upper == node->lower && node->left == node->right)
+        {
+            return;
+        }
+        bool verticalSplit;
+        unsigned int splitCoordinate =
+            ChooseSplit(s, index, node->upper, node->left, node->lower, node->right, verticalSplit);
+        double gain = s.GetSumSqDev(node->upper, node->left, node->lower, node->right) -
+                      SplitScore(s, node->upper, node->left, node->lower, node->right, verticalSplit, splitCoordinate);
+        queue.push({gain, queued++, node, index, verticalSplit, splitCoordinate});
+    };
+
+    root = new ImgTreeNode(0, 0, imgheight - 1, imgwidth - 1, s.GetAvg(0, 0, imgheight - 1, imgwidth - 1));
+    enqueue(root, 0);
+    for (unsigned int leaves = 1; leaves < budget.leaves && !queue.empty(); leaves++)
     {
-        // Horizontal split
-        verticalSplit = false;
-        splitCoordinate = 
-        (s, upr, lft, lwr, rt, verticalSplit);
+        Candidate c = queue.top();
+        queue.pop();
+        ImgTreeNode *node = c.node;
+        if (c.vertical)
+        {
+            node->A = new ImgTreeNode(node->upper, node->left, node->lower, c.coordinate,
+                                      s.GetAvg(node->upper, node->left, node->lower, c.coordinate));
+            node->B = new ImgTreeNode(node->upper, c.coordinate + 1, node->lower, node->right,
+                                      s.GetAvg(node->upper, c.coordinate + 1, node->lower, node->right));
+        }
+        else
+        {
+            node->A = new ImgTreeNode(node->upper, node->left, c.coordinate, node->right,
+                                      s.GetAvg(node->upper, node->left, c.coordinate, node->right));
+            node->B = new ImgTreeNode(c.coordinate + 1, node->left, node->lower, node->right,
+                                      s.GetAvg(c.coordinate + 1, node->left, node->lower, node->right));
+        }
+        size_t pixelsA = (size_t)(node->A->lower - node->A->upper + 1) * (node->A->right - node->A->left + 1);
+        enqueue(node->A, c.index + 1);
+        enqueue(node->B, c.index + pixelsA);
     }
+    CloseSplitLog(logPath, s.imageHash, log);
+}
 
-    // Recursively build child nodes
-    if (verticalSplit)
+/**
+ *  Builds the whole tree for an imgwidth x imgheight image from s, serially or on a pool of threads.
+ *  Either way the tree is the same, since each node's split depends only on its own rectangle.
+ *  @param threads - number of threads to build with; 1 builds serially
+ *  @return - pointer to the root of the completed tree
+ */
+ImgTreeNode *ImgTree::BuildTree(Stats &s, unsigned int threads, const function<bool(const ImgTreeNode &)> &keepWhole)
+{
+    if (threads <= 1)
     {
-        node->A = BuildNode(s, upr, lft, lwr, splitCoordinate);
-        node->B = BuildNode(s, upr, splitCoordinate + 1, lwr, rt);
+        return BuildNode(s, 0, 0, imgheight - 1, imgwidth - 1, 0, keepWhole);
     }
-    else
+
+    ImgTreeNode *top = nullptr;
+    TaskPool pool(threads);
+    pool.Run([&]() { BuildNodeTask(pool, s, 0, 0, imgheight - 1, imgwidth - 1, 0, &top, keepWhole); });
+    return top;
+}
+
+/**
+ *  Task-parallel version of BuildNode: builds the node for the given rectangle into *slot, hands
+ *  its first child to the pool as a separate task and carries on with the second. Rectangles of
+ *  fewer than ParallelBuildCutoff pixels are built serially by BuildNode.
+ *  @param pool - the pool running this task
+ *  @param index - the node's index in splitLog
+ *  @param slot - where to store the pointer to the completed node
+ *  @param keepWhole - as for BuildNode; called from several threads at once
+ */
+void ImgTree::BuildNodeTask(TaskPool &pool, Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+                            size_t index, ImgTreeNode **slot, const function<bool(const ImgTreeNode &)> &keepWhole)
+{
+    // the second child is carried on by this loop rather than a nested call, so lopsided splits
+    // cannot deepen the call stack
+    while ((unsigned long)(lwr - upr + 1) * (rt - lft + 1) >= ParallelBuildCutoff)
     {
-        node->A = BuildNode(s, upr, lft, splitCoordinate, rt);
-        node->B = BuildNode(s, splitCoordinate + 1, lft, lwr, rt);
+        // same node, split and children as BuildNode; a rectangle this large is never a single pixel
+        RGBAPixel avg = s.GetAvg(upr, lft, lwr, rt);
+
+        if (keepWhole && keepWhole(ImgTreeNode(upr, lft, lwr, rt, avg)))
+        {
+            *slot = new ImgTreeNode(upr, lft, lwr, rt, avg);
+            return;
+        }
+
+        unsigned int row, column;
+        if (FindQuadSplit(s, upr, lft, lwr, rt, row, column))
+        {
+            ImgTreeQuadNode *quad = new ImgTreeQuadNode(upr, lft, lwr, rt, avg);
+            *slot = quad;
+            pool.Spawn([=, &pool, &s, &keepWhole]() { BuildNodeTask(pool, s, upr, lft, row, column, 0, &quad->A, keepWhole); });
+            pool.Spawn([=, &pool, &s, &keepWhole]() { BuildNodeTask(pool, s, upr, column + 1, row, rt, 0, &quad->B, keepWhole); });
+            pool.Spawn([=, &pool, &s, &keepWhole]() { BuildNodeTask(pool, s, row + 1, lft, lwr, column, 0, &quad->C, keepWhole); });
+            upr = row + 1;
+            lft = column + 1;
+            slot = &quad->D;
+            continue;
+        }
+
+        ImgTreeNode *node = new ImgTreeNode(upr, lft, lwr, rt, avg);
+        *slot = node;
+
+        bool verticalSplit;
+        unsigned int splitCoordinate = ChooseSplit(s, index, upr, lft, lwr, rt, verticalSplit);
+
+        if (verticalSplit)
+        {
+            pool.Spawn([=, &pool, &s, &keepWhole]() { BuildNodeTask(pool, s, upr, lft, lwr, splitCoordinate, index + 1, &node->A, keepWhole); });
+            index += (size_t)(lwr - upr + 1) * (splitCoordinate - lft + 1);
+            lft = splitCoordinate + 1;
+        }
+        else
+        {
+            pool.Spawn([=, &pool, &s, &keepWhole]() { BuildNodeTask(pool, s, upr, lft, splitCoordinate, rt, index + 1, &node->A, keepWhole); });
+            index += (size_t)(splitCoordinate - upr + 1) * (rt - lft + 1);
+            upr = splitCoordinate + 1;
+        }
+        slot = &node->B;
     }
 
-    return node;
+    *slot = BuildNode(s, upr, lft, lwr, rt, index, keepWhole);
 }
 
 /**
@@ -194,6 +539,14 @@ unsigned int ImgTree::CountLeaves() const
     return CountLeavesR(root);
 }
 
+/**
+ *  Read-only access to the tree's nodes, for comparing the shapes of two trees.
+ */
+const ImgTreeNode* ImgTree::GetRoot() const
+{
+    return root;
+}
+
 /**
  *  ADD YOUR PRIVATE FUNCTION IMPLEMENTATIONS BELOW
  */
@@ -204,160 +557,496 @@ void ImgTree::renderLeaf(PNG &targetPic, unsigned int scale, ImgTreeNode *subTre
     {
         return;
     }
-    // Base case: leaf node, paint on the picture.
-    if (subTree->A == nullptr && subTree->B == nullptr)
+    vector<ImgTreeNode *> stack;
+    stack.reserve(StackBound(subTree->upper, subTree->left, subTree->lower, subTree->right));
+    stack.push_back(subTree);
+    while (!stack.empty())
     {
-        for (size_t x = subTree->left; x <= subTree->right; x++)
+        ImgTreeNode *node = stack.back();
+        stack.pop_back();
+        // leaf node: paint on the picture.
+        if (node->A == nullptr && node->B == nullptr)
         {
-            for (size_t y = subTree->upper; y <= subTree->lower; y++)
+            RGBAPixel refPix = node->avg;
+            for (size_t x = node->left; x <= node->right; x++)
             {
-                RGBAPixel refPix = subTree->avg;
-                for (size_t targetX = x * scale; targetX < (x + 1) * scale; targetX++)
+                for (size_t y = node->upper; y <= node->lower; y++)
                 {
-                    for (size_t targetY = y * scale; targetY < (y + 1) * scale; targetY++)
+                    for (size_t targetX = x * scale; targetX < (x + 1) * scale; targetX++)
                     {
-                        *targetPic.getPixel(targetX, targetY) = refPix;
+                        for (size_t targetY = y * scale; targetY < (y + 1) * scale; targetY++)
+                        {
+                            *targetPic.getPixel(targetX, targetY) = refPix;
+                        }
                     }
                 }
             }
+            continue;
+        }
+        // otherwise get to the leaf nodes below it
+        const ImgTreeQuadNode *quad = ImgTreeQuadNode::Of(node);
+        if (quad != nullptr)
+        {
+            stack.push_back(quad->D);
+            stack.push_back(quad->C);
+        }
+        for (ImgTreeNode *child : {node->B, node->A})
+        {
+            if (child != nullptr)
+            {
+                stack.push_back(child);
+            }
         }
-        return;
     }
-    // recurvise step: get to the leaf node.
-    if (subTree->A != nullptr)
+}
+
+unsigned int ImgTree::FindBestSplit(Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt, bool vertical)
+{
+    // Find the best split coordinate that minimizes the sum of squared deviations
+    unsigned int candidates = vertical ? rt - lft : lwr - upr;
+    if (approximateSplits && candidates >= ApproximateSplitMin)
     {
-        renderLeaf(targetPic, scale, subTree->A);
+        return FindApproximateSplit(s, upr, lft, lwr, rt, vertical);
     }
-    if (subTree->B != nullptr)
+
+    static const SplitSweepKernel sweep = SplitSweepKernelFor(BestSimdLevel());
+
+    // project the node onto the axis across the cuts once, then sweep every candidate over that strip.
+    // The buffer is reused from node to node.
+    static thread_local vector<uint64_t> strip;
+    s.GatherSplitStrip(upr, lft, lwr, rt, vertical, strip);
+
+    // ties go to the cut closest to the middle of the rectangle, measured along the cut's own axis
+    unsigned int first = vertical ? lft : upr;
+    unsigned int extent = vertical ? rt - lft + 1 : lwr - upr + 1;
+    int half = extent / 2 + first;
+    if (extent % 2 == 0)
     {
-        renderLeaf(targetPic, scale, subTree->B);
+        half--;
     }
+
+    unsigned int span = vertical ? lwr - upr + 1 : rt - lft + 1;
+    return sweep(strip.data(), extent - 1, span, s.opaque, first, half);
 }
 
-unsigned int ImgTree::FindBestSplit(Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt, bool vertical)
+/**
+ *  Coarse-to-fine version of FindBestSplit for rectangles with many candidates. Scores every
+ *  stride-th cut, stride being about the square root of the number of candidates, then scores
+ *  every cut within a stride of the ApproximateSplitRefine best of those, and picks among the
+ *  cuts scored with FindBestSplit's rules. Each cut costs two GetSumSqDev calls, so the search
+ *  takes O(sqrt(candidates)) calls rather than a pass over the whole rectangle.
+ *
+ *  The exact best cut is at most stride / 2 rows or columns from a sampled one, and moving a cut
+ *  by one row or column moves span pixels, each adding at most 4 * 255^2 to the part it joins and
+ *  nothing to the part it leaves. So the chosen cut scores at most
+ *  ceil(stride / 2) * span * 4 * 255^2 more than the exact best one, and usually exactly as well.
+ */
+unsigned int ImgTree::FindApproximateSplit(Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+                                           bool vertical)
 {
-    // Find the best split coordinate that minimizes the sum of squared deviations
-    unsigned int bestSplit = (vertical ? lft - 1 : upr - 1);
-    double minSumSq = 1e12;
+    auto score = [&](unsigned int coord) { return SplitScore(s, upr, lft, lwr, rt, vertical, coord); };
+
+    // the same middle as FindBestSplit
+    unsigned int first = vertical ? lft : upr;
+    unsigned int extent = vertical ? rt - lft + 1 : lwr - upr + 1;
+    int half = extent / 2 + first;
+    if (extent % 2 == 0)
+    {
+        half--;
+    }
+    unsigned int last = first + extent - 2;
+    unsigned int stride = (unsigned int)ceil(sqrt((double)(extent - 1)));
+
+    // coarse pass: every stride-th cut and the last one, best first
+    vector<pair<double, unsigned int>> coarse;
+    for (unsigned int coord = first; ; coord += stride)
+    {
+        coord = min(coord, last);
+        coarse.push_back({score(coord), coord});
+        if (coord == last)
+        {
+            break;
+        }
+    }
+    // ranked as FindBestSplit ranks cuts, so that among tied samples the windows go to the middle
+    auto better = [half](const pair<double, unsigned int> &c1, const pair<double, unsigned int> &c2) {
+        int d1 = abs(half - (int)c1.second);
+        int d2 = abs(half - (int)c2.second);
+        return c1.first < c2.first || (c1.first == c2.first && (d1 < d2 || (d1 == d2 && c1.second < c2.second)));
+    };
+    size_t refined = min((size_t)ApproximateSplitRefine, coarse.size());
+    partial_sort(coarse.begin(), coarse.begin() + refined, coarse.end(), better);
 
-    if (vertical)
+    // fine pass: every cut within a stride of the best coarse ones, in increasing order so that
+    // ties are settled as in FindBestSplit
+    vector<pair<unsigned int, unsigned int>> windows;
+    for (size_t i = 0; i < refined; i++)
     {
-        for (unsigned int i = lft; i < rt; ++i)
+        unsigned int coord = coarse[i].second;
+        windows.push_back({coord - min(coord - first, stride - 1), min(coord + stride - 1, last)});
+    }
+    sort(windows.begin(), windows.end());
+
+    // start from the best coarse cut, which the windows cover, so that no score is too large to win
+    unsigned int best = coarse[0].second;
+    double minScore = coarse[0].first;
+    unsigned int next = first;
+    for (const pair<unsigned int, unsigned int> &window : windows)
+    {
+        for (unsigned int coord = max(window.first, next); coord <= window.second; coord++)
         {
-            double sumSqLeft = s.GetSumSqDev(upr, lft, lwr, i);
-            double sumSqRight = s.GetSumSqDev(upr, i + 1, lwr, rt);
-            double sumSq = sumSqLeft + sumSqRight;
-            if (sumSq < minSumSq)
+            double cut = score(coord);
+            if (cut < minScore)
             {
-                minSumSq = sumSq;
-                bestSplit = i;
-                continue;
+                minScore = cut;
+                best = coord;
             }
-            if (sumSq == minSumSq)
+            else if (cut == minScore && abs(half - (int)coord) < abs(half - (int)best))
             {
-                int half = -1;
-                int width = rt - lft + 1;
-                if (width % 2 == 0)
-                {
-                    half = width / 2 + lft - 1;
-                }
-                else
-                {
-                    half = width / 2 + lft;
-                }
-
-                if (abs(half - (int)i) < abs(half - (int)bestSplit))
-                {
-                    bestSplit = i;
-                }
+                best = coord;
             }
         }
+        next = max(next, window.second + 1);
     }
-    else
+    return best;
+}
+
+/**
+ *  Combined sum squared deviation of the two parts of a rectangle cut after the given coordinate
+ */
+double ImgTree::SplitScore(Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt, bool vertical,
+                           unsigned int coordinate)
+{
+    return vertical ? s.GetSumSqDev(upr, lft, lwr, coordinate) + s.GetSumSqDev(upr, coordinate + 1, lwr, rt)
+                    : s.GetSumSqDev(upr, lft, coordinate, rt) + s.GetSumSqDev(coordinate + 1, lft, lwr, rt);
+}
+
+/**
+ *  Split for the node with the given index in splitLog and the given rectangle of more than one
+ *  pixel: the one recorded by an earlier build if splitLog is being replayed, and otherwise the one
+ *  FindBestSplit finds, recorded if splitLog is being recorded. A recorded split outside the
+ *  rectangle is ignored.
+ *  The cut is vertical if the region is at least as wide as it is tall, horizontal otherwise;
+ *  with bothOrientations, the other orientation is searched as well and taken if its best cut
+ *  leaves strictly less sum squared deviation.
+ *  @param vertical - set to the orientation of the cut
+ *  @return coordinate of the cut; the first part ends at this row or column
+ */
+unsigned int ImgTree::ChooseSplit(Stats &s, size_t index, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+                                  bool &vertical)
+{
+    if (replaySplits)
     {
-        for (unsigned int i = upr; i < lwr; ++i)
+        vertical = (splitLog[index] & SplitLogVertical) != 0;
+        unsigned int coordinate = splitLog[index] & ~SplitLogVertical;
+        if (vertical ? coordinate >= lft && coordinate < rt : coordinate >= upr && coordinate < lwr)
         {
-            double sumSqUpper = s.GetSumSqDev(upr, lft, i, rt);
-            double sumSqLower = s.GetSumSqDev(i + 1, lft, lwr, rt);
-            double sumSq = sumSqUpper + sumSqLower;
-            if (sumSq < minSumSq)
-            {
-                minSumSq = sumSq;
-                bestSplit = i;
-            }
-            if (sumSq == minSumSq)
-            {
-                int half = -1;
-                int height = lwr - upr + 1;
-                if (height % 2 == 0)
-                {
-                    half = height / 2 + lft - 1;
-                }
-                else
-                {
-                    half = height / 2 + lft;
-                }
+            return coordinate;
+        }
+    }
 
-                if (abs(half - (int)i) < abs(half - (int)bestSplit))
-                {
-                    bestSplit = i;
-                }
-            }
+    vertical = (rt - lft) >= (lwr - upr);
+    unsigned int coordinate = FindBestSplit(s, upr, lft, lwr, rt, vertical);
+    // both orientations are possible only if the region is more than one pixel wide and tall
+    if (bothOrientations && lft != rt && upr != lwr)
+    {
+        unsigned int other = FindBestSplit(s, upr, lft, lwr, rt, !vertical);
+        if (SplitScore(s, upr, lft, lwr, rt, !vertical, other) < SplitScore(s, upr, lft, lwr, rt, vertical, coordinate))
+        {
+            vertical = !vertical;
+            coordinate = other;
         }
     }
 
-    return bestSplit;
+    if (recordSplits)
+    {
+        splitLog[index] = coordinate | (vertical ? SplitLogVertical : 0);
+    }
+    return coordinate;
 }
 
-void ImgTree::FlipHorizontalR(ImgTreeNode *subTree)
+/**
+ *  Cuts for a quad split of the given rectangle, if quadSplits is set and the rectangle is more
+ *  than one pixel wide and tall: the best vertical and the best horizontal cut, each found by
+ *  FindBestSplit over the whole rectangle. The four parts are, in A, B, C, D order, upper left,
+ *  upper right, lower left and lower right.
+ *  @param row - set to the last row of the upper parts
+ *  @param column - set to the last column of the left parts
+ *  @return false, with row and column unset, if the rectangle is to be split in two instead
+ */
+bool ImgTree::FindQuadSplit(Stats &s, unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt,
+                            unsigned int &row, unsigned int &column)
 {
-    if (subTree == nullptr)
+    if (!quadSplits || upr == lwr || lft == rt)
     {
-        return;
+        return false;
+    }
+    column = FindBestSplit(s, upr, lft, lwr, rt, true);
+    row = FindBestSplit(s, upr, lft, lwr, rt, false);
+    return true;
+}
+
+/**
+ *  Start of a split log file, followed by one uint32_t split per node of the whole tree of more
+ *  than one pixel, in splitLog order and encoding
+ */
+struct SplitLogHeader
+{
+    char magic[8];        // SplitLogMagic
+    uint64_t hash;        // PNG::computeHash() of the source image, as in Stats::imageHash
+    uint32_t width;
+    uint32_t height;
+    uint32_t approximate; // whether the splits were searched coarse-to-fine
+    uint32_t bothOrientations; // whether both orientations of each split were searched
+    uint64_t count;       // number of splits that follow
+};
+
+// identifies a split log file, and the version of its format and of the split rules it records
+static const char SplitLogMagic[8] = {'P', 'A', '3', 'S', 'P', 'L', '0', '3'};
+
+/**
+ *  Name of the split log file, within StatsOptions::cacheDirectory, for the tree of an image
+ *  @param imageHash - PNG::computeHash() of the image
+ *  @param width - image width
+ *  @param height - image height
+ *  @param approximate - whether the splits are searched coarse-to-fine
+ *  @param bothOrientations - whether both orientations of each split are searched
+ *  @return file name, without a directory
+ */
+string ImgTree::SplitLogFileName(size_t imageHash, unsigned int width, unsigned int height, bool approximate,
+                                 bool bothOrientations)
+{
+    ostringstream name;
+    name << "splits-" << hex << setw(16) << setfill('0') << imageHash << dec << "-" << width << "x" << height << "-"
+         << (approximate ? "approximate" : "exhaustive") << (bothOrientations ? "-both" : "") << ".log";
+    return name.str();
+}
+
+/**
+ *  Sets up splitLog for a build from s. With treeOptions.cacheSplits and a cache directory, the splits
+ *  saved by an earlier build of the same image are loaded to be replayed; failing that, if record
+ *  is set, log is sized for this build to record its splits into. Otherwise splits are searched as usual.
+ *  @param record - whether this build makes the whole tree, so that its splits are worth saving
+ *  @param log - storage for splitLog; left empty if there is nothing to replay or record
+ *  @return path of the split log file, or empty if splits are not cached
+ */
+string ImgTree::OpenSplitLog(const Stats &s, const StatsOptions &options, const ImgTreeOptions &treeOptions, bool record,
+                             vector<uint32_t> &log)
+{
+    splitLog = nullptr;
+    replaySplits = false;
+    recordSplits = false;
+    if (!treeOptions.cacheSplits || options.cacheDirectory.empty() || quadSplits)
+    {
+        return "";
+    }
+
+    string path = options.cacheDirectory + "/" +
+                  SplitLogFileName(s.imageHash, imgwidth, imgheight, approximateSplits, bothOrientations);
+    if (LoadSplitLog(path, s.imageHash, log))
+    {
+        replaySplits = true;
+        splitLog = log.data();
+    }
+    else if (record)
+    {
+        log.assign((size_t)imgwidth * imgheight - 1, 0);
+        recordSplits = true;
+        splitLog = log.data();
+    }
+    return path;
+}
+
+/**
+ *  Ends a build begun with OpenSplitLog, saving the splits it recorded, if any, to path
+ */
+void ImgTree::CloseSplitLog(const string &path, size_t imageHash, const vector<uint32_t> &log)
+{
+    if (recordSplits)
+    {
+        SaveSplitLog(path, imageHash, log);
+    }
+    splitLog = nullptr;
+    replaySplits = false;
+    recordSplits = false;
+}
+
+/**
+ *  Reads the split log file at path into log, if it exists and was saved for an image with the
+ *  given hash and this tree's dimensions, searched the way this tree searches
+ *  @return false if there is no usable split log file
+ */
+bool ImgTree::LoadSplitLog(const string &path, size_t imageHash, vector<uint32_t> &log) const
+{
+    ifstream in(path, ios::binary);
+    SplitLogHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        memcmp(header.magic, SplitLogMagic, sizeof(header.magic)) != 0 || header.hash != imageHash ||
+        header.width != imgwidth || header.height != imgheight || header.approximate != (uint32_t)approximateSplits ||
+        header.bothOrientations != (uint32_t)bothOrientations || header.count != (uint64_t)imgwidth * imgheight - 1)
+    {
+        return false;
+    }
+
+    log.resize(header.count);
+    if (!in.read(reinterpret_cast<char *>(log.data()), header.count * sizeof(uint32_t)))
+    {
+        log.clear();
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Writes log to a split log file that a later build of the same image can replay
+ *  @param path - file to write; replaced atomically if it exists
+ *  @return false, with a warning printed, if the file could not be written
+ */
+bool ImgTree::SaveSplitLog(const string &path, size_t imageHash, const vector<uint32_t> &log) const
+{
+    SplitLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SplitLogMagic, sizeof(header.magic));
+    header.hash = imageHash;
+    header.width = imgwidth;
+    header.height = imgheight;
+    header.approximate = approximateSplits;
+    header.bothOrientations = bothOrientations;
+    header.count = log.size();
+
+    // write under a temporary name and rename, so that a reader never sees a partial file
+    string tmpPath = path + ".tmp";
+    ofstream out(tmpPath, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(log.data()), log.size() * sizeof(uint32_t));
+    out.close();
+    if (!out || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        cerr << "WARNING: ImgTree could not write the split log " << path << endl;
+        remove(tmpPath.c_str());
+        return false;
     }
-    if (subTree->A == nullptr && subTree->B == nullptr)
+    return true;
+}
+
+void ImgTree::FlipHorizontalR(ImgTreeNode *subTree)
+{
+    if (subTree == nullptr)
     {
-        subTree->left = imgwidth - subTree->left - 1;
-        subTree->right = imgwidth - subTree->right - 1;
-        swap(subTree->left, subTree->right);
         return;
     }
-    else
+    vector<ImgTreeNode *> stack;
+    stack.reserve(StackBound(subTree->upper, subTree->left, subTree->lower, subTree->right));
+    stack.push_back(subTree);
+    while (!stack.empty())
     {
-        FlipHorizontalR(subTree->A);
-        FlipHorizontalR(subTree->B);
+        ImgTreeNode *node = stack.back();
+        stack.pop_back();
+        if (node->A == nullptr && node->B == nullptr)
+        {
+            node->left = imgwidth - node->left - 1;
+            node->right = imgwidth - node->right - 1;
+            swap(node->left, node->right);
+            continue;
+        }
+        ImgTreeQuadNode *quad = ImgTreeQuadNode::Of(node);
+        if (quad != nullptr)
+        {
+            stack.push_back(quad->D);
+            stack.push_back(quad->C);
+        }
+        for (ImgTreeNode *child : {node->B, node->A})
+        {
+            if (child != nullptr)
+            {
+                stack.push_back(child);
+            }
+        }
     }
 }
 
 int ImgTree::CountLeavesR(ImgTreeNode *subTree) const
 {
-    if (subTree->A == nullptr && subTree->B == nullptr)
+    if (subTree == nullptr)
     {
-        return 1;
+        return 0;
     }
-    else
+    int leaves = 0;
+    vector<ImgTreeNode *> stack;
+    stack.reserve(StackBound(subTree->upper, subTree->left, subTree->lower, subTree->right));
+    stack.push_back(subTree);
+    while (!stack.empty())
     {
-        return CountLeavesR(subTree->A) + CountLeavesR(subTree->B);
+        ImgTreeNode *node = stack.back();
+        stack.pop_back();
+        if (node->A == nullptr && node->B == nullptr)
+        {
+            leaves++;
+            continue;
+        }
+        const ImgTreeQuadNode *quad = ImgTreeQuadNode::Of(node);
+        if (quad != nullptr)
+        {
+            stack.push_back(quad->D);
+            stack.push_back(quad->C);
+        }
+        for (ImgTreeNode *child : {node->B, node->A})
+        {
+            if (child != nullptr)
+            {
+                stack.push_back(child);
+            }
+        }
     }
+    return leaves;
 }
 
 ImgTreeNode* ImgTree::Copy(ImgTreeNode *const &originSubTree)
 {
+    // each original node with the child pointer its copy goes into
+    ImgTreeNode *top = nullptr;
     if (originSubTree == nullptr)
     {
-        return nullptr;
+        return top;
     }
-    else
+    vector<pair<ImgTreeNode *, ImgTreeNode **>> stack;
+    stack.reserve(StackBound(originSubTree->upper, originSubTree->left, originSubTree->lower,
+                             originSubTree->right));
+    stack.push_back(make_pair(originSubTree, &top));
+    while (!stack.empty())
     {
-        ImgTreeNode *subTree= new ImgTreeNode(originSubTree->upper,
-                                                originSubTree->left,
-                                                originSubTree->lower,
-                                                originSubTree->right,
-                                                originSubTree->avg);
-        subTree->A = Copy(originSubTree->A);
-        subTree->B = Copy(originSubTree->B);
-        return subTree;
+        ImgTreeNode *origin = stack.back().first;
+        ImgTreeNode **slot = stack.back().second;
+        stack.pop_back();
+        ImgTreeNode *subTree;
+        ImgTreeQuadNode *originQuad = ImgTreeQuadNode::Of(origin);
+        if (originQuad != nullptr)
+        {
+            ImgTreeQuadNode *quad = new ImgTreeQuadNode(origin->upper, origin->left, origin->lower, origin->right,
+                                                        origin->avg);
+            stack.push_back(make_pair(originQuad->D, &quad->D));
+            stack.push_back(make_pair(originQuad->C, &quad->C));
+            subTree = quad;
+        }
+        else
+        {
+            subTree = new ImgTreeNode(origin->upper,
+                                      origin->left,
+                                      origin->lower,
+                                      origin->right,
+                                      origin->avg);
+        }
+        *slot = subTree;
+        if (origin->B != nullptr)
+        {
+            stack.push_back(make_pair(origin->B, &subTree->B));
+        }
+        if (origin->A != nullptr)
+        {
+            stack.push_back(make_pair(origin->A, &subTree->A));
+        }
     }
+    return top;
 }
 
 void ImgTree::Clear(ImgTreeNode *subTree)
@@ -366,13 +1055,48 @@ void ImgTree::Clear(ImgTreeNode *subTree)
     {
         return;
     }
-    Clear(subTree->A);
-    Clear(subTree->B);
-    delete subTree;
-    subTree = nullptr;
+    vector<ImgTreeNode *> stack;
+    stack.reserve(StackBound(subTree->upper, subTree->left, subTree->lower, subTree->right));
+    stack.push_back(subTree);
+    while (!stack.empty())
+    {
+        ImgTreeNode *node = stack.back();
+        stack.pop_back();
+        ImgTreeQuadNode *quad = ImgTreeQuadNode::Of(node);
+        if (quad != nullptr)
+        {
+            stack.push_back(quad->D);
+            stack.push_back(quad->C);
+        }
+        for (ImgTreeNode *child : {node->B, node->A})
+        {
+            if (child != nullptr)
+            {
+                stack.push_back(child);
+            }
+        }
+        // a quad node is deleted as what it is; the base class has no virtual destructor
+        if (quad != nullptr)
+        {
+            delete quad;
+        }
+        else
+        {
+            delete node;
+        }
+    }
 }
 
-void ImgTree::PruneLeavesR(double pct, double tol, ImgTreeNode *subTree)
+size_t ImgTree::StackBound(unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt) const
+{
+    // each level down shrinks the rectangle by at least one row or column, and a depth-first
+    // stack holds at most one waiting sibling per level less than the branching factor, plus
+    // the children of the node being visited
+    size_t branching = quadSplits ? 4 : 2;
+    return (branching - 1) * ((size_t)(lwr - upr) + (rt - lft)) + 2;
+}
+
+void ImgTree::PruneLeavesR(double pct, double tol, ImgTreeNode *&subTree)
 {
     // trivial case
     if (subTree == nullptr)
@@ -380,24 +1104,51 @@ void ImgTree::PruneLeavesR(double pct, double tol, ImgTreeNode *subTree)
         return;
     }
 
-    size_t tolLeaves = CountTolerantLeavesR(tol, subTree, subTree->avg);
-    size_t totalLeaves = CountLeavesR(subTree);
-    if (totalLeaves == 0)
+    // child pointers still to visit, top-down, so that each subtree is pruned as high as possible;
+    // the slots let a pruned quad node be replaced
+    vector<ImgTreeNode **> stack;
+    stack.reserve(StackBound(subTree->upper, subTree->left, subTree->lower, subTree->right));
+    stack.push_back(&subTree);
+    while (!stack.empty())
     {
-        return;
-    }
+        ImgTreeNode **slot = stack.back();
+        stack.pop_back();
+        ImgTreeNode *node = *slot;
 
-    double tolPct = (double)tolLeaves / (double)totalLeaves * 100.0;
-    if (tolPct >= pct)
-    {
-        Clear(subTree->A);
-        Clear(subTree->B);
-        subTree->A = nullptr;
-        subTree->B = nullptr;
-    }
+        size_t tolLeaves = CountTolerantLeavesR(tol, node, node->avg);
+        size_t totalLeaves = CountLeavesR(node);
+        double tolPct = (double)tolLeaves / (double)totalLeaves * 100.0;
+        ImgTreeQuadNode *quad = ImgTreeQuadNode::Of(node);
+        if (tolPct >= pct && quad != nullptr)
+        {
+            // a leaf is a plain node, so a pruned quad node is replaced
+            *slot = new ImgTreeNode(node->upper, node->left, node->lower, node->right, node->avg);
+            Clear(node);
+            continue;
+        }
+        if (tolPct >= pct)
+        {
+            Clear(node->A);
+            Clear(node->B);
+            node->A = nullptr;
+            node->B = nullptr;
+            continue;
+        }
 
-    PruneLeavesR(pct, tol, subTree->A);
-    PruneLeavesR(pct, tol, subTree->B);
+        if (quad != nullptr)
+        {
+            stack.push_back(&quad->D);
+            stack.push_back(&quad->C);
+        }
+        if (node->B != nullptr)
+        {
+            stack.push_back(&node->B);
+        }
+        if (node->A != nullptr)
+        {
+            stack.push_back(&node->A);
+        }
+    }
 }
 
 int ImgTree::CountTolerantLeavesR(double tol, ImgTreeNode *subTree, RGBAPixel avg)
@@ -406,15 +1157,36 @@ int ImgTree::CountTolerantLeavesR(double tol, ImgTreeNode *subTree, RGBAPixel av
     {
         return 0;
     }
-    if (subTree->A == nullptr && subTree->B == nullptr)
+    int leaves = 0;
+    vector<ImgTreeNode *> stack;
+    stack.reserve(StackBound(subTree->upper, subTree->left, subTree->lower, subTree->right));
+    stack.push_back(subTree);
+    while (!stack.empty())
     {
-        // check tolerance;
-        double colorDist = avg.dist(subTree->avg);
-        if (colorDist <= tol)
+        ImgTreeNode *node = stack.back();
+        stack.pop_back();
+        if (node->A == nullptr && node->B == nullptr)
         {
-            return 1;
+            // check tolerance;
+            if (avg.dist(node->avg) <= tol)
+            {
+                leaves++;
+            }
+            continue;
+        }
+        const ImgTreeQuadNode *quad = ImgTreeQuadNode::Of(node);
+        if (quad != nullptr)
+        {
+            stack.push_back(quad->D);
+            stack.push_back(quad->C);
+        }
+        for (ImgTreeNode *child : {node->B, node->A})
+        {
+            if (child != nullptr)
+            {
+                stack.push_back(child);
+            }
         }
-        return 0;
     }
-    return CountTolerantLeavesR(tol, subTree->A, avg) + CountTolerantLeavesR(tol, subTree->B, avg);
+    return leaves;
 }
\ No newline at end of file
@@ -18,6 +18,8 @@
 using namespace std;
 using namespace cs221util;
 
+class TaskPool;
+
 /**
  *  Node definition for the tree class.
  *  This is made public for testing, but in practice should be private.
@@ -33,8 +35,10 @@ class ImgTreeNode {
         unsigned int right;
         RGBAPixel avg;
 
-        ImgTreeNode* A; // ptr to left or upper subtree
-        ImgTreeNode* B; // ptr to right or lower subtree
+        ImgTreeNode* A; // ptr to left or upper subtree; upper left of a quad split
+        ImgTreeNode* B; // ptr to right or lower subtree; upper right of a quad split
+
+        bool isQuad; // true if this node was allocated as an ImgTreeQuadNode, and must be deleted as one
 
         /**
         *  Constructs an ImgTreeNode with null children
@@ -47,9 +51,73 @@ class ImgTreeNode {
             avg = average;
             A = nullptr;
             B = nullptr;
+            isQuad = false;
+        }
+};
+
+/**
+ *  Node of a quad split (see ImgTreeOptions::quadSplits), with the lower quadrants as extra children,
+ *  so that binary nodes do not carry them. A quad node is told apart by its isQuad flag; the base
+ *  class has no virtual destructor, so a quad node must be deleted through an ImgTreeQuadNode pointer.
+ */
+class ImgTreeQuadNode : public ImgTreeNode {
+    public:
+
+        ImgTreeNode* C; // ptr to lower left subtree
+        ImgTreeNode* D; // ptr to lower right subtree
+
+        /**
+        *  Constructs an ImgTreeQuadNode with null children
+        */
+        ImgTreeQuadNode(unsigned int upr, unsigned int lft, unsigned int lwr, unsigned int rt, RGBAPixel average)
+            : ImgTreeNode(upr, lft, lwr, rt, average) {
+            C = nullptr;
+            D = nullptr;
+            isQuad = true;
+        }
+
+        /**
+        *  @return node as a quad node, or nullptr if it was not allocated as one
+        */
+        static ImgTreeQuadNode* Of(ImgTreeNode* node) {
+            return node->isQuad ? static_cast<ImgTreeQuadNode*>(node) : nullptr;
+        }
+        static const ImgTreeQuadNode* Of(const ImgTreeNode* node) {
+            return Of(const_cast<ImgTreeNode*>(node));
+        }
+};
+
+/**
+ *  Leaf count for the leaf-budget ImgTree constructor. Its constructor is explicit, so a
+ *  number, such as the pct of the pruning constructor, cannot select that constructor.
+ */
+class LeafBudget {
+    public:
+
+        unsigned int leaves; // most leaves the tree may have; 0 is treated as 1
+
+        explicit LeafBudget(unsigned int maxLeaves) {
+            leaves = maxLeaves;
         }
 };
 
+/**
+ *  Construction-time settings for how an ImgTree chooses its splits.
+ */
+struct ImgTreeOptions {
+    bool approximateSplits = false; // if true, the splits of large rectangles are searched coarse-to-fine,
+                                    // in O(sqrt(width)) candidates instead of O(width), at a bounded cost
+                                    // in split quality
+    bool cacheSplits = false;       // if true and the StatsOptions name a cacheDirectory, a whole tree saves
+                                    // its split decisions there next to the Stats tables, and later trees of
+                                    // the same image replay them instead of searching for splits again
+    bool bothOrientations = false;  // if true, both orientations of every split are searched, at up to twice
+                                    // the cost, and the cut is along whichever leaves less sum squared deviation
+    bool quadSplits = false;        // if true, every node more than one pixel wide and tall is cut into four,
+                                    // along the best vertical and the best horizontal cut; leaf-budget trees
+                                    // stay binary, and quad trees' splits are not cached
+};
+
 class ImgTree {
     private:
         /**
@@ -83,7 +151,7 @@ class ImgTree {
         void Copy(const ImgTree& other);
 
         /**
-         *  Recursive helper function for initial construction of the tree. Constructs a single
+         *  Helper function for initial construction of the tree. Constructs a single
          *  node according to supplied Stats and the requirements specified by the constructor
          *  documentation, and returns a pointer to the completed node.
          *  @param s - populated Stats object for computing this node's attributes
@@ -136,8 +204,72 @@ class ImgTree {
          *     most evenly splits the rectangular area will be chosen.
          *  4. In the even more unlikely even that two candidates produce the same score and produce
          *     the same minimal area difference, the one with the smaller coordinate will be chosen.
+         *
+         *  @param img - input image
+         *  @param options - how the Stats tables used during construction are built and stored,
+         *                   e.g. in a spill file for images whose tables do not fit in memory;
+         *                   with more than one thread, large subtrees are also built in parallel
+         *  @param treeOptions - how the tree chooses its splits
+         */
+        ImgTree(const PNG& img, const StatsOptions& options = StatsOptions(),
+                const ImgTreeOptions& treeOptions = ImgTreeOptions());
+
+        /**
+         *  Region-of-interest constructor creates a tree from the rectangle of img bounded by upper, left,
+         *  lower and right, exactly as the constructor above would from an image holding only that rectangle.
+         *  Only the rectangle's Stats tables are built, so the cost is proportional to its area.
+         *  @pre upper, left, lower, and right are valid image coordinates
+         *  @param img - input image
+         *  @param upper - y-coordinate of the upper edge of the region
+         *  @param left - x-coordinate of the left side of the region
+         *  @param lower - y-coordinate of the lower edge of the region
+         *  @param right - x-coordinate of the right side of the region
+         *  @param options - how the Stats tables used during construction are built and stored
+         *  @param treeOptions - how the tree chooses its splits
+         */
+        ImgTree(const PNG& img, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                const StatsOptions& options = StatsOptions(), const ImgTreeOptions& treeOptions = ImgTreeOptions());
+
+        /**
+         *  Decoder constructor creates a tree straight from RGBA8 scanlines, as lodepng::decode
+         *  produces them, without an intermediate PNG. The tree is the one the first constructor
+         *  would build from the decoded PNG.
+         *  @param rgba - width * height pixels, row-major, 4 bytes each in r, g, b, a order
+         *  @param width - image width in pixels
+         *  @param height - image height in pixels
+         *  @param options - how the Stats tables used during construction are built and stored
+         *  @param treeOptions - how the tree chooses its splits
+         */
+        ImgTree(const unsigned char* rgba, unsigned int width, unsigned int height,
+                const StatsOptions& options = StatsOptions(), const ImgTreeOptions& treeOptions = ImgTreeOptions());
+
+        /**
+         *  Pruning constructor creates the tree that the first constructor followed by Prune(pct, tol)
+         *  would leave, without ever allocating the nodes that Prune would delete: a node is kept as a
+         *  leaf as soon as at least pct (out of 100) of the pixels under it are within tol of its average.
+         *  The tables are built as options say; the tree itself is built serially.
+         *  @pre pct is a valid value between 0 and 100
+         *  @param img - input image
+         *  @param pct - percentage (out of 100) of pixels that must be within the tolerance for a node to stay whole
+         *  @param tol - threshold color difference to qualify for pruning
+         *  @param options - how the Stats tables used during construction are built and stored
+         *  @param treeOptions - how the tree chooses its splits
+         */
+        ImgTree(const PNG& img, double pct, double tol, const StatsOptions& options = StatsOptions(),
+                const ImgTreeOptions& treeOptions = ImgTreeOptions());
+
+        /**
+         *  Leaf-budget constructor grows the tree best-first: starting from the root, it repeatedly splits
+         *  the leaf whose split removes the most sum squared deviation, until the tree has budget.leaves leaves
+         *  or every leaf is a single pixel. Each split is the one the first constructor makes for the same
+         *  rectangle, so the result is the top of that tree. Nodes and queued leaves are O(budget.leaves).
+         *  @param img - input image
+         *  @param budget - most leaves the tree may have, as LeafBudget(n)
+         *  @param options - how the Stats tables used during construction are built and stored
+         *  @param treeOptions - how the tree chooses its splits
          */
-        ImgTree(const PNG& img);
+        ImgTree(const PNG& img, LeafBudget budget, const StatsOptions& options = StatsOptions(),
+                const ImgTreeOptions& treeOptions = ImgTreeOptions());
 
         /**
          *  Copy constructor creates a new tree that is structurally the same as the input tree and
@@ -195,6 +327,24 @@ class ImgTree {
          */
         unsigned int CountLeaves() const;
 
+        /**
+         *  Read-only access to the tree's nodes, for comparing the shapes of two trees.
+         *  @return the root node, or nullptr for an empty tree
+         */
+        const ImgTreeNode* GetRoot() const;
+
+        /**
+         *  Name of the split log file, within StatsOptions::cacheDirectory, for the tree of an image
+         *  @param imageHash - PNG::computeHash() of the image
+         *  @param width - image width
+         *  @param height - image height
+         *  @param approximate - whether the splits are searched coarse-to-fine
+         *  @param bothOrientations - whether both orientations of each split are searched
+         *  @return file name, without a directory
+         */
+        static string SplitLogFileName(size_t imageHash, unsigned int width, unsigned int height, bool approximate,
+                                       bool bothOrientations);
+
     private:
         // In the file included below, write your definitions for any private functions you find useful.
         #include "imgtree-private.h"
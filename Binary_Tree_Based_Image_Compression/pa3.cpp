@@ -13,10 +13,17 @@
  *  THIS FILE WILL NOT BE SUBMITTED TO PRAIRIELEARN
  */
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
 
+#include "cs221util/lodepng/lodepng.h"
 #include "imgtree.h"
+#include "stats-simd.h"
 
 using namespace cs221util;
 using namespace std;
@@ -33,9 +40,26 @@ void TestImgTreeFlipHorizontal();
 void TestImgTreeCountLeavesPrune();
 void TestCountLeaves();
 void TestCopy();
-
-// Test support function
+void TestStatsBuildOptions();
+void TestStatsTranslucent();
+void TestStatsCache();
+void TestStatsUpdate();
+void TestStatsCrop();
+void TestStatsDecoded();
+void TestSplitScores();
+void TestSplitSweepKernels();
+void TestImgTreeBuildThreads();
+void TestImgTreeDegenerate();
+void TestImgTreeBuildPruned();
+void TestImgTreeLeafBudget();
+void TestImgTreeApproximateSplits();
+void TestImgTreeSplitCache();
+void TestImgTreeBothOrientations();
+void TestImgTreeQuadSplits();
+
+// Test support functions
 void SetImagePaths(int imgnum);
+bool SameNodes(const ImgTreeNode* n1, const ImgTreeNode* n2, bool topOnly = false);
 
 // Program entry point
 int main(int argc, char *argv[])
@@ -56,6 +80,22 @@ int main(int argc, char *argv[])
 	// TestCountLeaves();
 	TestCopy();
 	// TestImgTreeCountLeavesPrune();
+	// TestStatsBuildOptions();
+	// TestStatsTranslucent();
+	// TestStatsCache();
+	// TestStatsUpdate();
+	// TestStatsCrop();
+	// TestStatsDecoded();
+	// TestSplitScores();
+	// TestSplitSweepKernels();
+	// TestImgTreeBuildThreads();
+	// TestImgTreeDegenerate();
+	// TestImgTreeBuildPruned();
+	// TestImgTreeLeafBudget();
+	// TestImgTreeApproximateSplits();
+	// TestImgTreeSplitCache();
+	// TestImgTreeBothOrientations();
+	// TestImgTreeQuadSplits();
 
 	return 0;
 }
@@ -364,6 +404,29 @@ void SetImagePaths(int imgnum)
 	}
 }
 
+/**
+ *  Compares two trees node by node: rectangles and exact average colours, recursing on the children.
+ *  @param topOnly - when true, a leaf of n1 matches any node of n2 with the same content, so a
+ *                   truncated tree can be compared with the top of a complete one
+ *  @return true if the trees have the same shape and content
+ */
+bool SameNodes(const ImgTreeNode* n1, const ImgTreeNode* n2, bool topOnly)
+{
+	if (n1 == nullptr || n2 == nullptr)
+		return n1 == n2;
+	if (n1->upper != n2->upper || n1->left != n2->left || n1->lower != n2->lower || n1->right != n2->right ||
+		n1->avg.r != n2->avg.r || n1->avg.g != n2->avg.g || n1->avg.b != n2->avg.b || n1->avg.a != n2->avg.a)
+		return false;
+	if (topOnly && n1->A == nullptr && n1->B == nullptr)
+		return true;
+	const ImgTreeQuadNode* quad1 = ImgTreeQuadNode::Of(n1);
+	const ImgTreeQuadNode* quad2 = ImgTreeQuadNode::Of(n2);
+	if ((quad1 == nullptr) != (quad2 == nullptr))
+		return false;
+	return SameNodes(n1->A, n2->A, topOnly) && SameNodes(n1->B, n2->B, topOnly) &&
+		   (quad1 == nullptr || (SameNodes(quad1->C, quad2->C, topOnly) && SameNodes(quad1->D, quad2->D, topOnly)));
+}
+
 void TestCountLeaves()
 {
 	cout << "Entered TestCountLeaves..." << endl;
@@ -440,4 +503,929 @@ void TestCopy()
 
 	cout << "Leaving TestImgTreeBuildRender...\n"
 		 << endl;
+}
+
+void TestStatsBuildOptions()
+{
+	cout << "Entered TestStatsBuildOptions..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int w = inputimg.width();
+	unsigned int h = inputimg.height();
+
+	cout << "Creating reference Stats object (planar, serial)... ";
+	Stats reference(inputimg);
+	cout << "done." << endl;
+
+	const StatsLayout layouts[] = {StatsLayout::Planar, StatsLayout::Interleaved, StatsLayout::Blocked};
+	const char* names[] = {"planar", "interleaved", "blocked"};
+	const unsigned int threadCounts[] = {1, 2, 3, 8};
+	bool allmatch = true;
+	for (int l = 0; l < 3; l++)
+	{
+		StatsLayout layout = layouts[l];
+		for (unsigned int threads : threadCounts)
+		{
+			StatsOptions opts;
+			opts.layout = layout;
+			opts.threads = threads;
+			Stats st(inputimg, opts);
+
+			// every entry of the tables must match, as must the queries built on top of them
+			bool match = true;
+			for (unsigned int y = 0; y < h && match; y++)
+			{
+				for (unsigned int x = 0; x < w && match; x++)
+				{
+					match = st.GetSumSqDev(0, 0, y, x) == reference.GetSumSqDev(0, 0, y, x) &&
+							st.GetSumSqDev(y, x, h - 1, w - 1) == reference.GetSumSqDev(y, x, h - 1, w - 1) &&
+							st.GetAvg(0, x, y, w - 1) == reference.GetAvg(0, x, y, w - 1) &&
+							st.GetColorSum('g', y, 0, h - 1, x) == reference.GetColorSum('g', y, 0, h - 1, x) &&
+							st.GetAlphaSumSq(0, 0, y, x) == reference.GetAlphaSumSq(0, 0, y, x);
+				}
+			}
+			cout << names[l] << ", " << threads
+				 << " thread(s): " << (match ? "tables match." : "tables mismatch.") << endl;
+			allmatch = allmatch && match;
+		}
+	}
+
+	cout << (allmatch ? "All Stats variants match." : "Stats variant mismatch.") << endl;
+
+	cout << "Leaving TestStatsBuildOptions...\n"
+		 << endl;
+}
+
+void TestStatsTranslucent()
+{
+	cout << "Entered TestStatsTranslucent..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int w = inputimg.width();
+	unsigned int h = inputimg.height();
+
+	// give a checkerboard of pixels alpha 0.4 (102/255) so the alpha tables are needed
+	for (unsigned int x = 0; x < w; x++)
+	{
+		for (unsigned int y = 0; y < h; y++)
+		{
+			if ((x + y) % 2 == 1)
+				inputimg.getPixel(x, y)->a = 102 / 255.0;
+		}
+	}
+
+	Stats st(inputimg);
+	cout << "Stats reports opaque: " << (st.opaque ? "yes" : "no") << " (expected no)" << endl;
+
+	// compare the bottom-right quadrant against sums taken directly from the pixels
+	unsigned int upr = h / 2, lft = w / 2;
+	double totalA = 0.0, totalSqA = 0.0;
+	unsigned long totalR = 0, totalSqR = 0;
+	for (unsigned int x = lft; x < w; x++)
+	{
+		for (unsigned int y = upr; y < h; y++)
+		{
+			double a = inputimg.getPixel(x, y)->a * 255.0;
+			unsigned long r = inputimg.getPixel(x, y)->r;
+			totalA += a;
+			totalSqA += a * a;
+			totalR += r;
+			totalSqR += r * r;
+		}
+	}
+
+	bool match = st.GetAlphaSum(upr, lft, h - 1, w - 1) == totalA &&
+				 st.GetAlphaSumSq(upr, lft, h - 1, w - 1) == totalSqA &&
+				 st.GetColorSum('r', upr, lft, h - 1, w - 1) == totalR &&
+				 st.GetColorSumSq('r', upr, lft, h - 1, w - 1) == totalSqR;
+	cout << (match ? "Translucent sums match." : "Translucent sums mismatch.") << endl;
+
+	cout << "Leaving TestStatsTranslucent...\n"
+		 << endl;
+}
+
+void TestStatsCache()
+{
+	cout << "Entered TestStatsCache..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int w = inputimg.width();
+	unsigned int h = inputimg.height();
+	Stats reference(inputimg);
+
+	const StatsLayout layouts[] = {StatsLayout::Planar, StatsLayout::Blocked};
+	const char* names[] = {"planar", "blocked"};
+	bool allmatch = true;
+	for (int l = 0; l < 2; l++)
+	{
+		StatsOptions opts;
+		opts.layout = layouts[l];
+		opts.cacheDirectory = "/tmp";
+		string cachefile = opts.cacheDirectory + "/" + Stats::CacheFileName(inputimg.computeHash(), w, h, opts.layout);
+		remove(cachefile.c_str());
+
+		// the first Stats builds and saves the tables, the second maps the saved file
+		Stats built(inputimg, opts);
+		Stats loaded(inputimg, opts);
+		bool match = !built.cached && loaded.cached;
+		for (unsigned int y = 0; y < h && match; y++)
+		{
+			for (unsigned int x = 0; x < w && match; x++)
+			{
+				match = loaded.GetSumSqDev(0, 0, y, x) == reference.GetSumSqDev(0, 0, y, x) &&
+						loaded.GetSumSqDev(y, x, h - 1, w - 1) == reference.GetSumSqDev(y, x, h - 1, w - 1) &&
+						loaded.GetColorSum('b', y, 0, h - 1, x) == reference.GetColorSum('b', y, 0, h - 1, x);
+			}
+		}
+		// a copy of a mapped Stats must not depend on the mapping
+		Stats copied(loaded);
+		match = match && copied.GetSumSqDev(0, 0, h - 1, w - 1) == reference.GetSumSqDev(0, 0, h - 1, w - 1);
+		match = match && ImgTree(inputimg, opts).Render(1) == ImgTree(inputimg).Render(1);
+		remove(cachefile.c_str());
+
+		cout << names[l] << ": " << (match ? "cached tables match." : "cached tables mismatch.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All cached Stats match." : "Cached Stats mismatch.") << endl;
+
+	cout << "Leaving TestStatsCache...\n"
+		 << endl;
+}
+
+void TestStatsUpdate()
+{
+	cout << "Entered TestStatsUpdate..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int w = inputimg.width();
+	unsigned int h = inputimg.height();
+
+	// an opaque patch with inverted colours, then a translucent one overlapping it
+	unsigned int upr[] = {h / 3, h / 2};
+	unsigned int lft[] = {w / 4, w / 3};
+	PNG patches[] = {PNG(w - w / 4 - w / 3, h / 4 + 1), PNG(w / 2 + 1, h - h / 2)};
+	for (int p = 0; p < 2; p++)
+	{
+		for (unsigned int x = 0; x < patches[p].width(); x++)
+		{
+			for (unsigned int y = 0; y < patches[p].height(); y++)
+			{
+				RGBAPixel* px = inputimg.getPixel(lft[p] + x, upr[p] + y);
+				*patches[p].getPixel(x, y) = RGBAPixel(255 - px->r, px->b, px->g, p == 1 && (x + y) % 3 == 0 ? 51 / 255.0 : 1.0);
+			}
+		}
+	}
+
+	const StatsLayout layouts[] = {StatsLayout::Planar, StatsLayout::Interleaved, StatsLayout::Blocked};
+	const char* names[] = {"planar", "interleaved", "blocked"};
+	const unsigned int threadCounts[] = {1, 3};
+	bool allmatch = true;
+	for (int l = 0; l < 3; l++)
+	{
+		for (unsigned int threads : threadCounts)
+		{
+			StatsOptions opts;
+			opts.layout = layouts[l];
+			PNG editedimg = inputimg;
+			Stats st(inputimg, opts);
+
+			bool match = true;
+			for (int p = 0; p < 2; p++)
+			{
+				for (unsigned int x = 0; x < patches[p].width(); x++)
+				{
+					for (unsigned int y = 0; y < patches[p].height(); y++)
+						*editedimg.getPixel(lft[p] + x, upr[p] + y) = *patches[p].getPixel(x, y);
+				}
+				st.Update(patches[p], upr[p], lft[p], threads);
+
+				// the updated tables must match ones built from the edited image
+				Stats reference(editedimg, opts);
+				for (unsigned int y = 0; y < h && match; y++)
+				{
+					for (unsigned int x = 0; x < w && match; x++)
+					{
+						match = st.GetSumSqDev(0, 0, y, x) == reference.GetSumSqDev(0, 0, y, x) &&
+								st.GetSumSqDev(y, x, h - 1, w - 1) == reference.GetSumSqDev(y, x, h - 1, w - 1) &&
+								st.GetAlphaSum(y, 0, h - 1, x) == reference.GetAlphaSum(y, 0, h - 1, x) &&
+								st.GetColorSum('r', 0, x, y, w - 1) == reference.GetColorSum('r', 0, x, y, w - 1);
+					}
+				}
+			}
+			cout << names[l] << ", " << threads << " thread(s): "
+				 << (match ? "updated tables match." : "updated tables mismatch.") << endl;
+			allmatch = allmatch && match;
+		}
+	}
+
+	// updated cached tables are no longer the cached copy of the image: the cache file still holds the
+	// original tables, and the edited image is cached under its own hash
+	PNG editedimg = inputimg;
+	for (int p = 0; p < 2; p++)
+	{
+		for (unsigned int x = 0; x < patches[p].width(); x++)
+		{
+			for (unsigned int y = 0; y < patches[p].height(); y++)
+				*editedimg.getPixel(lft[p] + x, upr[p] + y) = *patches[p].getPixel(x, y);
+		}
+	}
+	StatsOptions opts;
+	opts.cacheDirectory = "/tmp";
+	string cachefiles[] = {opts.cacheDirectory + "/" + Stats::CacheFileName(inputimg.computeHash(), w, h, opts.layout),
+						   opts.cacheDirectory + "/" + Stats::CacheFileName(editedimg.computeHash(), w, h, opts.layout)};
+	for (const string& cachefile : cachefiles)
+		remove(cachefile.c_str());
+	Stats saved(inputimg, opts);
+	Stats updated(inputimg, opts);
+	bool match = updated.cached;
+	for (int p = 0; p < 2; p++)
+		updated.Update(patches[p], upr[p], lft[p], 1);
+	match = match && !updated.cached && updated.imageHash == 0;
+	Stats original(inputimg, opts);
+	Stats editedsaved(editedimg, opts);
+	Stats edited(editedimg, opts);
+	Stats reference(inputimg);
+	Stats editedreference(editedimg);
+	match = match && original.cached && !editedsaved.cached && edited.cached;
+	for (unsigned int y = 0; y < h && match; y++)
+	{
+		for (unsigned int x = 0; x < w && match; x++)
+		{
+			match = original.GetSumSqDev(0, 0, y, x) == reference.GetSumSqDev(0, 0, y, x) &&
+					edited.GetSumSqDev(0, 0, y, x) == editedreference.GetSumSqDev(0, 0, y, x) &&
+					updated.GetSumSqDev(y, x, h - 1, w - 1) == editedreference.GetSumSqDev(y, x, h - 1, w - 1);
+		}
+	}
+	for (const string& cachefile : cachefiles)
+		remove(cachefile.c_str());
+	cout << "cached tables: " << (match ? "update and cache round trip match." : "update and cache round trip mismatch.") << endl;
+	allmatch = allmatch && match;
+
+	cout << (allmatch ? "All updated Stats match." : "Updated Stats mismatch.") << endl;
+
+	cout << "Leaving TestStatsUpdate...\n"
+		 << endl;
+}
+
+void TestStatsCrop()
+{
+	cout << "Entered TestStatsCrop..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int upr = inputimg.height() / 5;
+	unsigned int lft = inputimg.width() / 3;
+	unsigned int lwr = inputimg.height() - 1 - inputimg.height() / 4;
+	unsigned int rt = inputimg.width() - 1 - inputimg.width() / 7;
+	unsigned int w = rt - lft + 1;
+	unsigned int h = lwr - upr + 1;
+
+	// the crop as an image of its own
+	PNG cropimg(w, h);
+	for (unsigned int x = 0; x < w; x++)
+	{
+		for (unsigned int y = 0; y < h; y++)
+			*cropimg.getPixel(x, y) = *inputimg.getPixel(lft + x, upr + y);
+	}
+
+	const StatsLayout layouts[] = {StatsLayout::Planar, StatsLayout::Interleaved, StatsLayout::Blocked};
+	const char* names[] = {"planar", "interleaved", "blocked"};
+	bool allmatch = true;
+	for (int l = 0; l < 3; l++)
+	{
+		StatsOptions opts;
+		opts.layout = layouts[l];
+		Stats cropped(inputimg, upr, lft, lwr, rt, opts);
+		Stats reference(cropimg, opts);
+		bool match = cropped.width == w && cropped.height == h;
+		for (unsigned int y = 0; y < h && match; y++)
+		{
+			for (unsigned int x = 0; x < w && match; x++)
+			{
+				match = cropped.GetSumSqDev(0, 0, y, x) == reference.GetSumSqDev(0, 0, y, x) &&
+						cropped.GetSumSqDev(y, x, h - 1, w - 1) == reference.GetSumSqDev(y, x, h - 1, w - 1) &&
+						cropped.GetColorSum('g', y, 0, h - 1, x) == reference.GetColorSum('g', y, 0, h - 1, x);
+			}
+		}
+		match = match && ImgTree(inputimg, upr, lft, lwr, rt, opts).Render(1) == ImgTree(cropimg).Render(1);
+
+		cout << names[l] << ": " << (match ? "cropped tables and tree match." : "cropped tables or tree mismatch.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All cropped Stats match." : "Cropped Stats mismatch.") << endl;
+
+	cout << "Leaving TestStatsCrop...\n"
+		 << endl;
+}
+
+void TestStatsDecoded()
+{
+	cout << "Entered TestStatsDecoded..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	vector<unsigned char> rgba;
+	unsigned int w, h;
+	lodepng::decode(rgba, w, h, input_img_path);
+
+	const StatsLayout layouts[] = {StatsLayout::Planar, StatsLayout::Interleaved, StatsLayout::Blocked};
+	const char* names[] = {"planar", "interleaved", "blocked"};
+	bool allmatch = true;
+	for (int l = 0; l < 3; l++)
+	{
+		StatsOptions opts;
+		opts.layout = layouts[l];
+		Stats decoded(rgba.data(), w, h, opts);
+		Stats reference(inputimg, opts);
+		bool match = decoded.width == inputimg.width() && decoded.height == inputimg.height() &&
+					 decoded.opaque == reference.opaque;
+		for (unsigned int y = 0; y < h && match; y++)
+		{
+			for (unsigned int x = 0; x < w && match; x++)
+			{
+				match = decoded.GetSumSqDev(0, 0, y, x) == reference.GetSumSqDev(0, 0, y, x) &&
+						decoded.GetSumSqDev(y, x, h - 1, w - 1) == reference.GetSumSqDev(y, x, h - 1, w - 1) &&
+						decoded.GetAlphaSum(y, 0, h - 1, x) == reference.GetAlphaSum(y, 0, h - 1, x);
+			}
+		}
+		match = match && ImgTree(rgba.data(), w, h, opts).Render(1) == ImgTree(inputimg, opts).Render(1);
+
+		// tables cached from the decoder output must be found again from the PNG
+		opts.cacheDirectory = "/tmp";
+		string cachefile = opts.cacheDirectory + "/" + Stats::CacheFileName(inputimg.computeHash(), w, h, opts.layout);
+		remove(cachefile.c_str());
+		Stats saved(rgba.data(), w, h, opts);
+		Stats loaded(inputimg, opts);
+		match = match && !saved.cached && loaded.cached;
+		remove(cachefile.c_str());
+
+		cout << names[l] << ": " << (match ? "decoded tables and tree match." : "decoded tables or tree mismatch.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All decoded Stats match." : "Decoded Stats mismatch.") << endl;
+
+	cout << "Leaving TestStatsDecoded...\n"
+		 << endl;
+}
+
+void TestSplitScores()
+{
+	cout << "Entered TestSplitScores..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int w = inputimg.width();
+	unsigned int h = inputimg.height();
+
+	// the image as it is, and with every third pixel translucent so the alpha tables are read
+	PNG translucentimg = inputimg;
+	for (unsigned int x = 0; x < w; x++)
+	{
+		for (unsigned int y = 0; y < h; y++)
+		{
+			if ((x + 2 * y) % 3 == 0)
+				translucentimg.getPixel(x, y)->a = 153 / 255.0;
+		}
+	}
+
+	const StatsLayout layouts[] = {StatsLayout::Planar, StatsLayout::Interleaved, StatsLayout::Blocked};
+	const char* names[] = {"planar", "interleaved", "blocked"};
+	bool allmatch = true;
+	for (int l = 0; l < 3; l++)
+	{
+		StatsOptions opts;
+		opts.layout = layouts[l];
+		bool match = true;
+		for (const PNG* img : {&inputimg, &translucentimg})
+		{
+			Stats st(*img, opts);
+			vector<double> scores;
+			// rectangles of assorted sizes and offsets, including ones touching row and column 0
+			for (unsigned int upr = 0; upr < h && match; upr += h / 5 + 1)
+			{
+				for (unsigned int lft = 0; lft < w && match; lft += w / 5 + 1)
+				{
+					unsigned int lwr = min(h - 1, upr + 2 * (upr + lft) % h);
+					unsigned int rt = min(w - 1, lft + 3 * (upr + lft + 1) % w);
+					st.GetSplitScores(upr, lft, lwr, rt, true, scores);
+					match = match && scores.size() == rt - lft;
+					for (unsigned int i = lft; i < rt && match; i++)
+						match = scores[i - lft] == st.GetSumSqDev(upr, lft, lwr, i) + st.GetSumSqDev(upr, i + 1, lwr, rt);
+					st.GetSplitScores(upr, lft, lwr, rt, false, scores);
+					match = match && scores.size() == lwr - upr;
+					for (unsigned int i = upr; i < lwr && match; i++)
+						match = scores[i - upr] == st.GetSumSqDev(upr, lft, i, rt) + st.GetSumSqDev(i + 1, lft, lwr, rt);
+				}
+			}
+		}
+		cout << names[l] << ": " << (match ? "split scores match." : "split scores mismatch.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All split scores match." : "Split scores mismatch.") << endl;
+
+	cout << "Leaving TestSplitScores...\n"
+		 << endl;
+}
+
+void TestSplitSweepKernels()
+{
+	cout << "Entered TestSplitSweepKernels..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int w = inputimg.width();
+	unsigned int h = inputimg.height();
+
+	// the image, a translucent version, and a flat one where every candidate ties
+	PNG translucentimg = inputimg;
+	PNG flatimg(w, h);
+	for (unsigned int x = 0; x < w; x++)
+	{
+		for (unsigned int y = 0; y < h; y++)
+		{
+			if ((x + y) % 4 == 0)
+				translucentimg.getPixel(x, y)->a = 51 / 255.0;
+			*flatimg.getPixel(x, y) = RGBAPixel(90, 180, 45);
+		}
+	}
+
+	const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2};
+	bool allmatch = true;
+	for (SimdLevel level : levels)
+	{
+		SplitSweepKernel sweep = SplitSweepKernelFor(level);
+		if (sweep == nullptr)
+		{
+			cout << SimdLevelName(level) << ": not supported on this CPU" << endl;
+			continue;
+		}
+
+		bool match = true;
+		for (const PNG* img : {&inputimg, &translucentimg, &flatimg})
+		{
+			Stats st(*img);
+			vector<uint64_t> strip;
+			for (unsigned int upr = 0; upr < h && match; upr += h / 6 + 1)
+			{
+				for (unsigned int lft = 0; lft < w && match; lft += w / 6 + 1)
+				{
+					unsigned int lwr = min(h - 1, upr + 3 * (upr + lft) % h);
+					unsigned int rt = min(w - 1, lft + 2 * (upr + lft + 1) % w);
+					for (bool vertical : {true, false})
+					{
+						// the original search: two GetSumSqDev calls per candidate, ties to the middle
+						unsigned int first = vertical ? lft : upr;
+						unsigned int last = vertical ? rt : lwr;
+						if (first == last)
+							continue;
+						int half = (last - first + 1) / 2 + first - ((last - first + 1) % 2 == 0 ? 1 : 0);
+						unsigned int expected = first - 1;
+						double minSumSq = numeric_limits<double>::infinity();
+						for (unsigned int i = first; i < last; i++)
+						{
+							double sumSq = vertical ? st.GetSumSqDev(upr, lft, lwr, i) + st.GetSumSqDev(upr, i + 1, lwr, rt)
+													: st.GetSumSqDev(upr, lft, i, rt) + st.GetSumSqDev(i + 1, lft, lwr, rt);
+							if (sumSq < minSumSq)
+							{
+								minSumSq = sumSq;
+								expected = i;
+							}
+							else if (sumSq == minSumSq && abs(half - (int)i) < abs(half - (int)expected))
+								expected = i;
+						}
+
+						st.GatherSplitStrip(upr, lft, lwr, rt, vertical, strip);
+						unsigned int span = vertical ? lwr - upr + 1 : rt - lft + 1;
+						match = match && sweep(strip.data(), last - first, span, st.opaque, first, half) == expected;
+					}
+				}
+			}
+		}
+
+		// every cut of a 4.8G-pixel strip of half-black, half-white columns scores about 2.4e14, and
+		// its parts hold more than 2^32 pixels; the scores must not wrap, and the choice must be one
+		// of the cuts, and the scalar kernel's
+		const unsigned int count = 17, span = 1u << 28;
+		vector<uint64_t> huge(8 * (count + 2), 0);
+		for (unsigned int c = 1; c <= count + 1; c++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				huge[k * (count + 2) + c] = (uint64_t)c * (span / 2) * 255;
+				huge[(4 + k) * (count + 2) + c] = (uint64_t)c * (span / 2) * 255 * 255;
+			}
+		}
+		vector<double> hugeScores(count);
+		SplitScoresScalar(huge.data(), count, span, true, hugeScores.data());
+		double hugeScore = 3.0 * (count + 1) * span * 255 * 255 / 4;
+		for (double score : hugeScores)
+			match = match && abs(score - hugeScore) < 1e-9 * hugeScore;
+		unsigned int choice = sweep(huge.data(), count, span, true, 0, count / 2);
+		match = match && choice < count && choice == SplitSweepScalar(huge.data(), count, span, true, 0, count / 2);
+
+		cout << SimdLevelName(level) << ": " << (match ? "split choices match." : "split choices mismatch.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All split sweep kernels match." : "Split sweep kernels mismatch.") << endl;
+
+	cout << "Leaving TestSplitSweepKernels...\n"
+		 << endl;
+}
+
+void TestImgTreeBuildThreads()
+{
+	cout << "Entered TestImgTreeBuildThreads..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+
+	ImgTree serial(inputimg);
+	ImgTree serialpruned(serial);
+	serialpruned.Prune(95, 0.02);
+
+	const unsigned int threadCounts[] = {2, 3, 8};
+	bool allmatch = true;
+	for (unsigned int threads : threadCounts)
+	{
+		StatsOptions opts;
+		opts.threads = threads;
+		ImgTree parallel(inputimg, opts);
+		bool match = SameNodes(parallel.GetRoot(), serial.GetRoot());
+		parallel.Prune(95, 0.02);
+		match = match && SameNodes(parallel.GetRoot(), serialpruned.GetRoot());
+
+		cout << threads << " threads: " << (match ? "tree matches serial build." : "tree differs from serial build.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All parallel builds match." : "Parallel builds mismatch.") << endl;
+
+	cout << "Leaving TestImgTreeBuildThreads...\n"
+		 << endl;
+}
+
+void TestImgTreeDegenerate()
+{
+	cout << "Entered TestImgTreeDegenerate..." << endl;
+
+	// one-pixel-wide strips: the traversals must cope with trees whose every node is a thin strip
+	const unsigned int length = 100000;
+	PNG strips[] = {PNG(1, length), PNG(length, 1)};
+	const char* names[] = {"1x100000", "100000x1"};
+	bool allmatch = true;
+	for (int i = 0; i < 2; i++)
+	{
+		for (unsigned int p = 0; p < length; p++)
+		{
+			unsigned char v = (unsigned char)(p * 256 / length);
+			*strips[i].getPixel(i == 0 ? 0 : p, i == 0 ? p : 0) = RGBAPixel(v, 255 - v, v / 2);
+		}
+
+		bool match = true;
+		for (unsigned int threads : {1u, 4u})
+		{
+			StatsOptions opts;
+			opts.threads = threads;
+			ImgTree tree(strips[i], opts);
+			ImgTree copied(tree);
+			match = match && tree.CountLeaves() == length && copied.CountLeaves() == length &&
+					tree.Render(1) == strips[i] && copied.Render(1) == strips[i];
+			copied.FlipHorizontal();
+			copied.FlipHorizontal();
+			tree.Prune(100, 0);
+			match = match && copied.Render(1) == strips[i] && tree.Render(1) == strips[i];
+		}
+
+		cout << names[i] << ": " << (match ? "tree built, copied, counted, rendered, flipped and pruned." : "tree mismatch.")
+			 << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All degenerate trees match." : "Degenerate trees mismatch.") << endl;
+
+	cout << "Leaving TestImgTreeDegenerate...\n"
+		 << endl;
+}
+
+void TestImgTreeBuildPruned()
+{
+	cout << "Entered TestImgTreeBuildPruned..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+
+	ImgTree full(inputimg);
+
+	// (pct, tol) pairs from barely pruned to pruned down to the root
+	const double settings[][2] = {{95, 0.02}, {85, 0.02}, {99, 0.1}, {100, 0}, {0, 0}};
+	bool allmatch = true;
+	for (const double* setting : settings)
+	{
+		ImgTree pruned(full);
+		pruned.Prune(setting[0], setting[1]);
+		ImgTree built(inputimg, setting[0], setting[1]);
+		StatsOptions opts;
+		opts.threads = 4;
+		ImgTree threaded(inputimg, setting[0], setting[1], opts);
+
+		bool match = SameNodes(built.GetRoot(), pruned.GetRoot());
+		bool threadedMatch = SameNodes(threaded.GetRoot(), pruned.GetRoot());
+		cout << "pct " << setting[0] << ", tol " << setting[1] << ": " << built.CountLeaves() << " leaves, "
+			 << (match ? "matches build-then-prune" : "differs from build-then-prune")
+			 << (threadedMatch ? ", threaded build matches." : ", threaded build differs.") << endl;
+		allmatch = allmatch && match && threadedMatch;
+	}
+
+	cout << (allmatch ? "All pruned builds match." : "Pruned builds mismatch.") << endl;
+
+	cout << "Leaving TestImgTreeBuildPruned...\n"
+		 << endl;
+}
+
+void TestImgTreeLeafBudget()
+{
+	cout << "Entered TestImgTreeLeafBudget..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+
+	ImgTree full(inputimg);
+	unsigned int pixels = inputimg.width() * inputimg.height();
+
+	// budgets from the root alone up to past one leaf per pixel
+	const unsigned int budgets[] = {0, 1, 2, 10, 100, pixels / 2, pixels, pixels + 5};
+	bool allmatch = true;
+	for (unsigned int budget : budgets)
+	{
+		ImgTree budgeted(inputimg, LeafBudget(budget));
+		unsigned int expected = min(max(budget, 1u), pixels);
+		// every split is the whole tree's split, so the budgeted tree is the top of the whole tree,
+		// and with a leaf for every pixel it is the whole tree
+		bool match = budgeted.CountLeaves() == expected &&
+					 SameNodes(budgeted.GetRoot(), full.GetRoot(), budget < pixels);
+
+		cout << "budget " << budget << ": " << budgeted.CountLeaves() << " leaves, "
+			 << (match ? "as expected." : "leaf count or nodes mismatch.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	cout << (allmatch ? "All leaf budgets respected." : "Leaf budgets not respected.") << endl;
+
+	cout << "Leaving TestImgTreeLeafBudget...\n"
+		 << endl;
+}
+
+void TestImgTreeApproximateSplits()
+{
+	cout << "Entered TestImgTreeApproximateSplits..." << endl;
+
+	ImgTreeOptions approximate;
+	approximate.approximateSplits = true;
+	bool allmatch = true;
+
+	// a sharp edge between two colours is found wherever it falls, sampled or not
+	const unsigned int width = 1000;
+	const unsigned int edges[] = {1, 31, 32, 500, 777, 998};
+	for (unsigned int edge : edges)
+	{
+		PNG step(width, 3);
+		for (unsigned int x = 0; x < width; x++)
+			for (unsigned int y = 0; y < 3; y++)
+				*step.getPixel(x, y) = x <= edge ? RGBAPixel(200, 40, 10) : RGBAPixel(10, 90, 250);
+
+		ImgTree tree(step, StatsOptions(), approximate);
+		tree.Prune(100, 0);
+		bool match = tree.CountLeaves() == 2 && tree.Render(1) == step;
+		cout << "edge after column " << edge << ": " << (match ? "split at the edge." : "edge missed.") << endl;
+		allmatch = allmatch && match;
+	}
+
+	// on a flat image every cut ties, so both searches must take the middle cut, including the
+	// horizontal cuts of nodes right of column 0
+	PNG flat(200, 640);
+	for (unsigned int x = 0; x < flat.width(); x++)
+		for (unsigned int y = 0; y < flat.height(); y++)
+			*flat.getPixel(x, y) = RGBAPixel(70, 140, 210);
+	bool match = SameNodes(ImgTree(flat, StatsOptions(), approximate).GetRoot(), ImgTree(flat).GetRoot());
+	cout << "flat image: " << (match ? "ties split as in the exhaustive search." : "ties split differently.") << endl;
+	allmatch = allmatch && match;
+
+	// approximate splits still give a tree with one leaf per pixel
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	ImgTree tree(inputimg, StatsOptions(), approximate);
+	match = tree.CountLeaves() == inputimg.width() * inputimg.height() && tree.Render(1) == inputimg;
+	cout << (match ? "Approximate tree renders the image." : "Approximate tree does not render the image.") << endl;
+	allmatch = allmatch && match;
+
+	cout << (allmatch ? "All approximate splits match." : "Approximate splits mismatch.") << endl;
+
+	cout << "Leaving TestImgTreeApproximateSplits...\n"
+		 << endl;
+}
+
+void TestImgTreeSplitCache()
+{
+	cout << "Entered TestImgTreeSplitCache..." << endl;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+
+	// a one-pixel image has no splits, but its empty log must still be saved and replayed
+	PNG pixel(1, 1);
+	*pixel.getPixel(0, 0) = RGBAPixel(12, 34, 56);
+
+	PNG* images[] = {&inputimg, &pixel};
+	const char* names[] = {"input image", "1x1 image"};
+	bool allmatch = true;
+	for (int i = 0; i < 2; i++)
+	{
+		const PNG& img = *images[i];
+		unsigned int w = img.width();
+		unsigned int h = img.height();
+
+		ImgTree reference(img);
+		ImgTree referencePruned(img, 95, 0.02);
+		ImgTree referenceBudget(img, LeafBudget(10));
+
+		StatsOptions opts;
+		opts.cacheDirectory = "/tmp";
+		ImgTreeOptions splitCache;
+		splitCache.cacheSplits = true;
+		string cachefile = opts.cacheDirectory + "/" + Stats::CacheFileName(img.computeHash(), w, h, opts.layout);
+		string logfile = opts.cacheDirectory + "/" + ImgTree::SplitLogFileName(img.computeHash(), w, h, false, false);
+		remove(cachefile.c_str());
+		remove(logfile.c_str());
+
+		// the first tree searches and saves its splits, the others replay them
+		ImgTree recorded(img, opts, splitCache);
+		bool saved = ifstream(logfile).good();
+		cout << names[i] << ": " << (saved ? "split log saved." : "split log not saved.") << endl;
+
+		ImgTree replayed(img, opts, splitCache);
+		bool match = SameNodes(recorded.GetRoot(), reference.GetRoot()) &&
+					 SameNodes(replayed.GetRoot(), reference.GetRoot());
+		cout << names[i] << ", whole tree: " << (match ? "replay matches." : "replay mismatch.") << endl;
+		bool imgmatch = saved && match;
+
+		opts.threads = 3;
+		ImgTree parallel(img, opts, splitCache);
+		match = SameNodes(parallel.GetRoot(), reference.GetRoot());
+		cout << names[i] << ", parallel tree: " << (match ? "replay matches." : "replay mismatch.") << endl;
+		imgmatch = imgmatch && match;
+
+		ImgTree pruned(img, 95, 0.02, opts, splitCache);
+		ImgTree budget(img, LeafBudget(10), opts, splitCache);
+		match = SameNodes(pruned.GetRoot(), referencePruned.GetRoot()) &&
+				SameNodes(budget.GetRoot(), referenceBudget.GetRoot());
+		cout << names[i] << ", pruned and leaf-budget trees: " << (match ? "replay matches." : "replay mismatch.")
+			 << endl;
+		imgmatch = imgmatch && match;
+
+		remove(cachefile.c_str());
+		remove(logfile.c_str());
+		allmatch = allmatch && imgmatch;
+	}
+
+	cout << (allmatch ? "All replayed trees match." : "Replayed trees mismatch.") << endl;
+
+	cout << "Leaving TestImgTreeSplitCache...\n"
+		 << endl;
+}
+
+void TestImgTreeBothOrientations()
+{
+	cout << "Entered TestImgTreeBothOrientations..." << endl;
+
+	ImgTreeOptions both;
+	both.bothOrientations = true;
+	bool allmatch = true;
+
+	// a wide image split by a horizontal edge: only a horizontal cut separates the two colours
+	PNG bands(64, 8);
+	for (unsigned int x = 0; x < bands.width(); x++)
+		for (unsigned int y = 0; y < bands.height(); y++)
+			*bands.getPixel(x, y) = y < 3 ? RGBAPixel(200, 40, 10) : RGBAPixel(10, 90, 250);
+	ImgTree byAspect(bands);
+	byAspect.Prune(100, 0);
+	ImgTree byScore(bands, StatsOptions(), both);
+	byScore.Prune(100, 0);
+	bool match = byScore.CountLeaves() == 2 && byScore.Render(1) == bands && byAspect.CountLeaves() > 2;
+	cout << "bands: " << byAspect.CountLeaves() << " leaves by aspect ratio, " << byScore.CountLeaves() << " leaves by score, "
+		 << (match ? "as expected." : "expected 2 by score.") << endl;
+	allmatch = allmatch && match;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+	unsigned int w = inputimg.width();
+	unsigned int h = inputimg.height();
+
+	// still one leaf per pixel, serially, in parallel, and replayed from a split log
+	ImgTree tree(inputimg, StatsOptions(), both);
+	match = tree.CountLeaves() == w * h && tree.Render(1) == inputimg;
+	StatsOptions options;
+	options.threads = 3;
+	options.cacheDirectory = "/tmp";
+	ImgTreeOptions splitCache = both;
+	splitCache.cacheSplits = true;
+	string cachefile = options.cacheDirectory + "/" + Stats::CacheFileName(inputimg.computeHash(), w, h, options.layout);
+	string logfile = options.cacheDirectory + "/" + ImgTree::SplitLogFileName(inputimg.computeHash(), w, h, false, true);
+	remove(cachefile.c_str());
+	remove(logfile.c_str());
+	ImgTree recorded(inputimg, options, splitCache);
+	ImgTree replayed(inputimg, options, splitCache);
+	match = match && SameNodes(recorded.GetRoot(), tree.GetRoot()) && SameNodes(replayed.GetRoot(), tree.GetRoot());
+	tree.Prune(95, 0.02);
+	replayed.Prune(95, 0.02);
+	match = match && SameNodes(replayed.GetRoot(), tree.GetRoot());
+	remove(cachefile.c_str());
+	remove(logfile.c_str());
+	cout << "image: " << (match ? "trees match." : "trees mismatch.") << endl;
+	allmatch = allmatch && match;
+
+	cout << (allmatch ? "All both-orientation trees match." : "Both-orientation trees mismatch.") << endl;
+
+	cout << "Leaving TestImgTreeBothOrientations...\n"
+		 << endl;
+}
+
+void TestImgTreeQuadSplits()
+{
+	cout << "Entered TestImgTreeQuadSplits..." << endl;
+
+	ImgTreeOptions quad;
+	quad.quadSplits = true;
+	bool allmatch = true;
+
+	// four uneven blocks of colour: one quad split separates them all
+	PNG blocks(9, 7);
+	for (unsigned int x = 0; x < blocks.width(); x++)
+		for (unsigned int y = 0; y < blocks.height(); y++)
+			*blocks.getPixel(x, y) = RGBAPixel(x < 3 ? 200 : 20, y < 5 ? 40 : 160, 90);
+	ImgTree blocktree(blocks, StatsOptions(), quad);
+	blocktree.Prune(100, 0);
+	ImgTree blockcopy(blocktree);
+	bool match = blocktree.CountLeaves() == 4 && blocktree.Render(1) == blocks;
+	cout << "blocks: " << blocktree.CountLeaves() << " leaves, " << (match ? "as expected." : "expected 4.") << endl;
+	allmatch = allmatch && match;
+	match = ImgTreeQuadNode::Of(blocktree.GetRoot()) != nullptr && ImgTreeQuadNode::Of(blockcopy.GetRoot()) != nullptr &&
+			ImgTreeQuadNode::Of(ImgTree(blocks).GetRoot()) == nullptr;
+	cout << "blocks: " << (match ? "node kinds as built." : "node kinds mismatch.") << endl;
+	allmatch = allmatch && match;
+
+	PNG inputimg;
+	cout << "input img name:" << input_img_path << endl;
+	inputimg.readFromFile(input_img_path);
+
+	// one leaf per pixel; copies and flips render as the binary tree's do
+	ImgTree binary(inputimg);
+	ImgTree tree(inputimg, StatsOptions(), quad);
+	ImgTree copied(tree);
+	match = tree.CountLeaves() == binary.CountLeaves() && tree.Render(1) == inputimg &&
+			SameNodes(copied.GetRoot(), tree.GetRoot()) && copied.Render(2) == binary.Render(2);
+	binary.FlipHorizontal();
+	copied.FlipHorizontal();
+	match = match && copied.Render(1) == binary.Render(1);
+	cout << "whole tree: " << (match ? "renders, copies and flips as the binary tree." : "differs from the binary tree.") << endl;
+	allmatch = allmatch && match;
+
+	// pruning the whole tree, pruning while building, and building in parallel agree
+	StatsOptions parallelopts;
+	parallelopts.threads = 3;
+	ImgTree parallel(inputimg, parallelopts, quad);
+	ImgTree pruned(inputimg, 95, 0.02, StatsOptions(), quad);
+	match = SameNodes(parallel.GetRoot(), tree.GetRoot());
+	tree.Prune(95, 0.02);
+	parallel.Prune(95, 0.02);
+	match = match && SameNodes(pruned.GetRoot(), tree.GetRoot()) && SameNodes(parallel.GetRoot(), tree.GetRoot());
+	cout << "pruned to " << tree.CountLeaves() << " leaves: " << (match ? "all builds match." : "builds mismatch.") << endl;
+	allmatch = allmatch && match;
+
+	cout << (allmatch ? "All quad trees match." : "Quad trees mismatch.") << endl;
+
+	cout << "Leaving TestImgTreeQuadSplits...\n"
+		 << endl;
 }
\ No newline at end of file
@@ -0,0 +1,382 @@
+/**
+ *  @file stats-simd.cpp
+ *  @description vectorized kernels used while building and searching the summed-area tables in Stats,
+ *   with runtime selection of the widest instruction set the CPU supports
+ *
+ *  THIS FILE WILL NOT BE SUBMITTED TO PRAIRIELEARN
+ */
+
+#include "stats-simd.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+// x86 kernels are compiled per function with target attributes, so the rest of the program
+// does not need -mavx2 and still runs on older CPUs
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define STATS_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define STATS_SIMD_X86 0
+#endif
+
+void RowPrefixScalar(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out)
+{
+  for (unsigned int i = 0; i < count; i++)
+  {
+    for (unsigned int c = 0; c < 4; c++)
+    {
+      uint64_t v = rgba[4 * i + c];
+      carry[c] += v;
+      carry[4 + c] += v * v;
+    }
+    memcpy(out + 8 * i, carry, 8 * sizeof(uint64_t));
+  }
+}
+
+/**
+ *  Combined score of cut i of a strip of count cuts, in the operation order of Stats::GetSumSqDev
+ */
+static double ScoreCut(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque, unsigned int i)
+{
+  size_t runs = (size_t)count + 2;
+  const uint64_t *r = strip, *g = r + runs, *b = g + runs, *a = b + runs;
+  const uint64_t *sqR = a + runs, *sqG = sqR + runs, *sqB = sqG + runs, *sqA = sqB + runs;
+  size_t c = (size_t)i + 1;
+  size_t end = (size_t)count + 1;
+
+  double nA = (double)((uint64_t)span * (i + 1));
+  double nB = (double)((uint64_t)span * (count - i));
+  uint64_t rA = r[c] - r[0], gA = g[c] - g[0], bA = b[c] - b[0];
+  uint64_t rB = r[end] - r[c], gB = g[end] - g[c], bB = b[end] - b[c];
+  double aA = opaque ? 255.0 * nA : (double)(a[c] - a[0]);
+  double aB = opaque ? 255.0 * nB : (double)(a[end] - a[c]);
+  double sqAA = opaque ? 255.0 * 255.0 * nA : (double)(sqA[c] - sqA[0]);
+  double sqAB = opaque ? 255.0 * 255.0 * nB : (double)(sqA[end] - sqA[c]);
+  double devA = (double)(sqR[c] - sqR[0]) - (double)rA * rA / nA;
+  devA += (double)(sqG[c] - sqG[0]) - (double)gA * gA / nA;
+  devA += (double)(sqB[c] - sqB[0]) - (double)bA * bA / nA;
+  devA += sqAA - aA * aA / nA;
+  double devB = (double)(sqR[end] - sqR[c]) - (double)rB * rB / nB;
+  devB += (double)(sqG[end] - sqG[c]) - (double)gB * gB / nB;
+  devB += (double)(sqB[end] - sqB[c]) - (double)bB * bB / nB;
+  devB += sqAB - aB * aB / nB;
+  return devA + devB;
+}
+
+void SplitScoresScalar(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque, double* scores)
+{
+  for (unsigned int i = 0; i < count; i++)
+  {
+    scores[i] = ScoreCut(strip, count, span, opaque, i);
+  }
+}
+
+unsigned int SplitSweepScalar(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque,
+                              unsigned int first, int half)
+{
+  unsigned int best = first;
+  double minScore = ScoreCut(strip, count, span, opaque, 0);
+  for (unsigned int i = 1; i < count; i++)
+  {
+    double score = ScoreCut(strip, count, span, opaque, i);
+    unsigned int coord = first + i;
+    if (score < minScore)
+    {
+      minScore = score;
+      best = coord;
+    }
+    else if (score == minScore && abs(half - (int)coord) < abs(half - (int)best))
+    {
+      best = coord;
+    }
+  }
+  return best;
+}
+
+#if STATS_SIMD_X86
+
+// fewest candidates worth sweeping in vector registers
+static const unsigned int SplitSweepMinVector = 16;
+
+/**
+ *  Four unsigned 64-bit integers to double, rounded as a scalar conversion rounds them:
+ *  both 32-bit halves convert exactly through the exponent bits, and one add rounds the total
+ */
+__attribute__((target("avx2")))
+static inline __m256d U64ToDouble(__m256i x)
+{
+  const __m256i hiExponent = _mm256_set1_epi64x(0x4530000000000000); // 2^84, ulp 2^32
+  const __m256i loExponent = _mm256_set1_epi64x(0x4330000000000000); // 2^52, ulp 1
+  const __m256d bothOffsets = _mm256_set1_pd(19342813118337666422669312.0 /* 2^84 + 2^52 */);
+  __m256i hi = _mm256_or_si256(_mm256_srli_epi64(x, 32), hiExponent);
+  __m256i lo = _mm256_blend_epi32(loExponent, x, 0x55);
+  return _mm256_add_pd(_mm256_sub_pd(_mm256_castsi256_pd(hi), bothOffsets), _mm256_castsi256_pd(lo));
+}
+
+/**
+ *  Sum of squared deviations of one channel for four candidates, given the sums and squared sums
+ *  of their parts and the parts' areas: sq - sum * sum / n
+ */
+__attribute__((target("avx2")))
+static inline __m256d ChannelDev(__m256i sum, __m256i sumSq, __m256d n)
+{
+  __m256d s = U64ToDouble(sum);
+  return _mm256_sub_pd(U64ToDouble(sumSq), _mm256_div_pd(_mm256_mul_pd(s, s), n));
+}
+
+__attribute__((target("avx2")))
+unsigned int SplitSweepAVX2(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque,
+                            unsigned int first, int half)
+{
+  // setting up the lanes and merging them costs more than a few scalar candidates
+  if (count < SplitSweepMinVector)
+  {
+    return SplitSweepScalar(strip, count, span, opaque, first, half);
+  }
+
+  size_t runs = (size_t)count + 2;
+  const uint64_t* run[8];
+  for (int k = 0; k < 8; k++)
+  {
+    run[k] = strip + k * runs;
+  }
+  __m256i before[8], all[8];
+  for (int k = 0; k < 8; k++)
+  {
+    before[k] = _mm256_set1_epi64x((long long)run[k][0]);
+    all[k] = _mm256_set1_epi64x((long long)run[k][count + 1]);
+  }
+
+  // every lane has at least four candidates, and its first one always replaces this placeholder
+  const __m256d signBit = _mm256_set1_pd(-0.0);
+  const __m256d halfCoord = _mm256_set1_pd(half);
+  __m256d bestScore = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+  __m256d bestCoord = _mm256_set1_pd(first);
+  __m256d bestDist = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+
+  // parts' column (row) counts in 64-bit lanes, whose low halves _mm256_mul_epu32 multiplies
+  __m256i spans = _mm256_set1_epi64x(span);
+  __m256i partsA = _mm256_setr_epi64x(1, 2, 3, 4);                                  // i + 1
+  __m256i partsB = _mm256_setr_epi64x(count, count - 1LL, count - 2LL, count - 3LL); // count - i
+  __m256d coord = _mm256_setr_pd(first, first + 1.0, first + 2.0, first + 3.0);
+  const __m256i fours = _mm256_set1_epi64x(4);
+  const __m256i laneIndex = _mm256_setr_epi64x(0, 1, 2, 3);
+  for (unsigned int i = 0; i < count; i += 4)
+  {
+    // the last group may be partial: its missing lanes read nothing and never win, so the whole
+    // sweep stays in vector registers with no scalar tail
+    __m256i valid = _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long)(count - i)), laneIndex);
+    // areas in 64 bits, as GetRectangleArea computes them
+    __m256d nA = U64ToDouble(_mm256_mul_epu32(spans, partsA));
+    __m256d nB = U64ToDouble(_mm256_mul_epu32(spans, partsB));
+    __m256i cut[8];
+    for (int k = 0; k < 8; k++)
+    {
+      cut[k] = _mm256_maskload_epi64(reinterpret_cast<const long long*>(run[k] + i + 1), valid);
+    }
+
+    __m256d aA, aB, sqAA, sqAB;
+    if (opaque)
+    {
+      aA = _mm256_mul_pd(_mm256_set1_pd(255.0), nA);
+      aB = _mm256_mul_pd(_mm256_set1_pd(255.0), nB);
+      sqAA = _mm256_mul_pd(_mm256_set1_pd(255.0 * 255.0), nA);
+      sqAB = _mm256_mul_pd(_mm256_set1_pd(255.0 * 255.0), nB);
+    }
+    else
+    {
+      aA = U64ToDouble(_mm256_sub_epi64(cut[3], before[3]));
+      aB = U64ToDouble(_mm256_sub_epi64(all[3], cut[3]));
+      sqAA = U64ToDouble(_mm256_sub_epi64(cut[7], before[7]));
+      sqAB = U64ToDouble(_mm256_sub_epi64(all[7], cut[7]));
+    }
+
+    __m256d devA = ChannelDev(_mm256_sub_epi64(cut[0], before[0]), _mm256_sub_epi64(cut[4], before[4]), nA);
+    devA = _mm256_add_pd(devA, ChannelDev(_mm256_sub_epi64(cut[1], before[1]), _mm256_sub_epi64(cut[5], before[5]), nA));
+    devA = _mm256_add_pd(devA, ChannelDev(_mm256_sub_epi64(cut[2], before[2]), _mm256_sub_epi64(cut[6], before[6]), nA));
+    devA = _mm256_add_pd(devA, _mm256_sub_pd(sqAA, _mm256_div_pd(_mm256_mul_pd(aA, aA), nA)));
+    __m256d devB = ChannelDev(_mm256_sub_epi64(all[0], cut[0]), _mm256_sub_epi64(all[4], cut[4]), nB);
+    devB = _mm256_add_pd(devB, ChannelDev(_mm256_sub_epi64(all[1], cut[1]), _mm256_sub_epi64(all[5], cut[5]), nB));
+    devB = _mm256_add_pd(devB, ChannelDev(_mm256_sub_epi64(all[2], cut[2]), _mm256_sub_epi64(all[6], cut[6]), nB));
+    devB = _mm256_add_pd(devB, _mm256_sub_pd(sqAB, _mm256_div_pd(_mm256_mul_pd(aB, aB), nB)));
+    __m256d score = _mm256_add_pd(devA, devB);
+
+    // a lane sees its candidates in coordinate order, so only a strictly better one replaces its best
+    __m256d dist = _mm256_andnot_pd(signBit, _mm256_sub_pd(halfCoord, coord));
+    __m256d better = _mm256_or_pd(_mm256_cmp_pd(score, bestScore, _CMP_LT_OQ),
+                                  _mm256_and_pd(_mm256_cmp_pd(score, bestScore, _CMP_EQ_OQ),
+                                                _mm256_cmp_pd(dist, bestDist, _CMP_LT_OQ)));
+    better = _mm256_and_pd(better, _mm256_castsi256_pd(valid));
+    bestScore = _mm256_blendv_pd(bestScore, score, better);
+    bestDist = _mm256_blendv_pd(bestDist, dist, better);
+    bestCoord = _mm256_blendv_pd(bestCoord, coord, better);
+
+    partsA = _mm256_add_epi64(partsA, fours);
+    partsB = _mm256_sub_epi64(partsB, fours);
+    coord = _mm256_add_pd(coord, _mm256_set1_pd(4.0));
+  }
+
+  // merge the lanes by score, then distance, then coordinate
+  double scores[4], dists[4], coords[4];
+  _mm256_storeu_pd(scores, bestScore);
+  _mm256_storeu_pd(dists, bestDist);
+  _mm256_storeu_pd(coords, bestCoord);
+  int lane = 0;
+  for (int l = 1; l < 4; l++)
+  {
+    if (scores[l] < scores[lane] || (scores[l] == scores[lane] &&
+                                     (dists[l] < dists[lane] || (dists[l] == dists[lane] && coords[l] < coords[lane]))))
+    {
+      lane = l;
+    }
+  }
+  unsigned int best = (unsigned int)(int)coords[lane];
+  return best;
+}
+
+__attribute__((target("sse4.1")))
+void RowPrefixSSE41(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out)
+{
+  __m128i sumRG = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carry));
+  __m128i sumBA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carry + 2));
+  __m128i sqRG = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carry + 4));
+  __m128i sqBA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carry + 6));
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    int32_t px;
+    memcpy(&px, rgba + 4 * i, sizeof(px));
+    __m128i packed = _mm_cvtsi32_si128(px);
+    __m128i rg = _mm_cvtepu8_epi64(packed);
+    __m128i ba = _mm_cvtepu8_epi64(_mm_srli_si128(packed, 2));
+
+    sumRG = _mm_add_epi64(sumRG, rg);
+    sumBA = _mm_add_epi64(sumBA, ba);
+    sqRG = _mm_add_epi64(sqRG, _mm_mul_epu32(rg, rg));
+    sqBA = _mm_add_epi64(sqBA, _mm_mul_epu32(ba, ba));
+
+    __m128i* dst = reinterpret_cast<__m128i*>(out + 8 * i);
+    _mm_storeu_si128(dst, sumRG);
+    _mm_storeu_si128(dst + 1, sumBA);
+    _mm_storeu_si128(dst + 2, sqRG);
+    _mm_storeu_si128(dst + 3, sqBA);
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(carry), sumRG);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(carry + 2), sumBA);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(carry + 4), sqRG);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(carry + 6), sqBA);
+}
+
+__attribute__((target("avx2")))
+void RowPrefixAVX2(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out)
+{
+  __m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(carry));
+  __m256i sq = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(carry + 4));
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    int32_t px;
+    memcpy(&px, rgba + 4 * i, sizeof(px));
+    __m256i v = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(px));
+
+    sum = _mm256_add_epi64(sum, v);
+    sq = _mm256_add_epi64(sq, _mm256_mul_epu32(v, v));
+
+    __m256i* dst = reinterpret_cast<__m256i*>(out + 8 * i);
+    _mm256_storeu_si256(dst, sum);
+    _mm256_storeu_si256(dst + 1, sq);
+  }
+
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(carry), sum);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(carry + 4), sq);
+}
+
+#else
+
+// no x86 vector kernels in this build; BestSimdLevel never selects these, and the scalar
+// kernel stands in if they are called directly
+void RowPrefixSSE41(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out)
+{
+  RowPrefixScalar(rgba, count, carry, out);
+}
+
+void RowPrefixAVX2(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out)
+{
+  RowPrefixScalar(rgba, count, carry, out);
+}
+
+unsigned int SplitSweepAVX2(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque,
+                            unsigned int first, int half)
+{
+  return SplitSweepScalar(strip, count, span, opaque, first, half);
+}
+
+#endif
+
+RowPrefixKernel RowPrefixKernelFor(SimdLevel level)
+{
+  if (level > BestSimdLevel())
+  {
+    return nullptr;
+  }
+  switch (level)
+  {
+  case SimdLevel::AVX2:
+    return RowPrefixAVX2;
+  case SimdLevel::SSE41:
+    return RowPrefixSSE41;
+  default:
+    return RowPrefixScalar;
+  }
+}
+
+SplitSweepKernel SplitSweepKernelFor(SimdLevel level)
+{
+  if (level > BestSimdLevel())
+  {
+    return nullptr;
+  }
+  return level == SimdLevel::AVX2 ? SplitSweepAVX2 : SplitSweepScalar;
+}
+
+/**
+ *  Asks the CPU which instruction sets it supports
+ */
+static SimdLevel DetectSimdLevel()
+{
+#if STATS_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return SimdLevel::AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1"))
+  {
+    return SimdLevel::SSE41;
+  }
+#endif
+  return SimdLevel::Scalar;
+}
+
+SimdLevel BestSimdLevel()
+{
+  static const SimdLevel best = DetectSimdLevel();
+  return best;
+}
+
+const char* SimdLevelName(SimdLevel level)
+{
+  switch (level)
+  {
+  case SimdLevel::AVX2:
+    return "avx2";
+  case SimdLevel::SSE41:
+    return "sse4.1";
+  default:
+    return "scalar";
+  }
+}
\ No newline at end of file
@@ -0,0 +1,106 @@
+/**
+ *  @file stats-simd.h
+ *  @description vectorized kernels used while building and searching the summed-area tables in Stats,
+ *   with runtime selection of the widest instruction set the CPU supports
+ *
+ *  THIS FILE WILL NOT BE SUBMITTED TO PRAIRIELEARN
+ */
+
+#ifndef _STATS_SIMD_H_
+#define _STATS_SIMD_H_
+
+#include <cstdint>
+
+/**
+ *  Signature shared by the row prefix kernels.
+ *  Computes running row sums over a run of RGBA8 pixels (4 bytes per pixel, in r, g, b, a order).
+ *  For pixel i, out[8*i] .. out[8*i+7] receive the sums of r, g, b, a, r^2, g^2, b^2, a^2
+ *  over pixels 0..i, on top of the totals passed in through carry.
+ *  @param rgba - count packed pixels
+ *  @param count - number of pixels in the run
+ *  @param carry - the eight running totals before the first pixel; updated to the totals after the last
+ *  @param out - 8 * count entries of output
+ */
+typedef void (*RowPrefixKernel)(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out);
+
+/**
+ *  Portable kernel, available everywhere.
+ */
+void RowPrefixScalar(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out);
+
+/**
+ *  SSE4.1 kernel: the r, g and b, a pairs are widened into 2 x 64-bit registers, two for the
+ *  sums and two for the squares.
+ */
+void RowPrefixSSE41(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out);
+
+/**
+ *  AVX2 kernel: one 4 x 64-bit register holds the r, g, b, a sums and another the squares,
+ *  so each pixel is a widen, a multiply, two adds and two stores.
+ */
+void RowPrefixAVX2(const unsigned char* rgba, unsigned int count, uint64_t carry[8], uint64_t* out);
+
+/**
+ *  Scores the count cuts of a strip laid out as by Stats::GatherSplitStrip (eight runs of count + 2
+ *  running sums), exactly as two Stats::GetSumSqDev calls per cut would.
+ *  @param span - extent of the rectangle along the cuts, so cut i leaves span * (i + 1) pixels before it
+ *  @param opaque - whether alpha follows from the area instead of the (zero) alpha runs
+ *  @param scores - count combined scores
+ */
+void SplitScoresScalar(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque, double* scores);
+
+/**
+ *  Signature shared by the split sweep kernels.
+ *  Scores the cuts of a strip as SplitScoresScalar does and picks the best one: the lowest score,
+ *  then the cut closest to half, then the lowest coordinate.
+ *  @pre count is at least 1
+ *  @param first - coordinate of the first cut; cut i splits after coordinate first + i
+ *  @param half - coordinate the tie-break distance is measured from
+ *  @return first + i for the best cut i
+ */
+typedef unsigned int (*SplitSweepKernel)(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque,
+                                         unsigned int first, int half);
+
+/**
+ *  Portable sweep: one candidate at a time, in coordinate order.
+ */
+unsigned int SplitSweepScalar(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque,
+                              unsigned int first, int half);
+
+/**
+ *  AVX2 sweep: four candidates per instruction, each lane keeping its own best score, distance
+ *  and coordinate, merged at the end. The 64-bit sums are converted to double with exactly the
+ *  rounding of a scalar conversion, and no multiply-adds are fused, so the scores and the choice
+ *  are the scalar kernel's.
+ */
+unsigned int SplitSweepAVX2(const uint64_t* strip, unsigned int count, unsigned int span, bool opaque,
+                            unsigned int first, int half);
+
+/**
+ *  Instruction sets with a row prefix kernel, from narrowest to widest.
+ */
+enum class SimdLevel { Scalar, SSE41, AVX2 };
+
+/**
+ *  Kernel for the given instruction set, or nullptr if this CPU/build cannot run it.
+ */
+RowPrefixKernel RowPrefixKernelFor(SimdLevel level);
+
+/**
+ *  Split sweep kernel for the given instruction set, or nullptr if this CPU/build cannot run it.
+ *  There is no SSE4.1 sweep; that level uses the scalar one.
+ */
+SplitSweepKernel SplitSweepKernelFor(SimdLevel level);
+
+/**
+ *  Widest instruction set that this CPU supports and this build has kernels for.
+ *  Detected once at runtime; the result is cached.
+ */
+SimdLevel BestSimdLevel();
+
+/**
+ *  Printable name of an instruction set level, e.g. "avx2"
+ */
+const char* SimdLevelName(SimdLevel level);
+
+#endif
\ No newline at end of file
@@ -8,305 +8,1417 @@
  */
 
 #include "stats.h"
+#include "stats-simd.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ *  First cache line boundary inside a storage buffer; the tables start here.
+ */
+static unsigned char *TableBase(const vector<unsigned char> &buffer)
+{
+  uintptr_t addr = reinterpret_cast<uintptr_t>(buffer.data());
+  return reinterpret_cast<unsigned char *>((addr + alignof(SumRecord) - 1) & ~(uintptr_t)(alignof(SumRecord) - 1));
+}
+
+/**
+ *  Adds (sign = 1) or subtracts (sign = -1) every running sum of rec into acc
+ */
+static void Accumulate(SumRecord &acc, const SumRecord &rec, int sign)
+{
+  if (sign > 0)
+  {
+    acc.r += rec.r;
+    acc.g += rec.g;
+    acc.b += rec.b;
+    acc.a += rec.a;
+    acc.sqR += rec.sqR;
+    acc.sqG += rec.sqG;
+    acc.sqB += rec.sqB;
+    acc.sqA += rec.sqA;
+  }
+  else
+  {
+    acc.r -= rec.r;
+    acc.g -= rec.g;
+    acc.b -= rec.b;
+    acc.a -= rec.a;
+    acc.sqR -= rec.sqR;
+    acc.sqG -= rec.sqG;
+    acc.sqB -= rec.sqB;
+    acc.sqA -= rec.sqA;
+  }
+}
+
+/**
+ *  True if every pixel of img in the rectangle bounded by upper, left, lower and right has alpha 1.0
+ */
+static bool IsOpaque(const PNG &img, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+{
+  for (unsigned int y = upper; y <= lower; y++)
+  {
+    for (unsigned int x = left; x <= right; x++)
+    {
+      if (img.getPixel(x, y)->a != 1.0)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ *  True if every one of the count RGBA8 pixels in rgba has alpha 255
+ */
+static bool IsOpaque(const unsigned char *rgba, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    if (rgba[4 * i + 3] != 255)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ *  dst[i] += src[i] for i in [0, count)
+ */
+template <typename T>
+static void AddInto(T *dst, const T *src, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    dst[i] += src[i];
+  }
+}
+
+/**
+ *  8-bit value of a [0, 1] alpha, i.e. alpha pre-multiplied by 255.0. Exact for every alpha
+ *  read from a PNG; anything in between is rounded to the nearest step.
+ */
+static unsigned char AlphaToByte(double alpha)
+{
+  double a = alpha * 255.0 + 0.5;
+  if (!(a > 0.0))
+  {
+    return 0;
+  }
+  if (a >= 255.0)
+  {
+    return 255;
+  }
+  return static_cast<unsigned char>(a);
+}
+
+/**
+ *  Longest run of pixels passed to the row prefix kernel at once; short enough for the packed
+ *  pixels and the kernel output to stay in L1
+ */
+static const unsigned int PrefixRunLength = 256;
+
+/**
+ *  Running row sums of the count <= PrefixRunLength pixels of row y starting at column x0,
+ *  continuing from carry, in the format of RowPrefixKernel
+ */
+static void PrefixRun(const PixelRowSource &rows, unsigned int x0, unsigned int y, unsigned int count, uint64_t carry[8], uint64_t *out)
+{
+  static const RowPrefixKernel kernel = RowPrefixKernelFor(BestSimdLevel());
+
+  unsigned char rgba[4 * PrefixRunLength];
+  rows(x0, y, count, rgba);
+  kernel(rgba, count, carry, out);
+}
+
+/**
+ *  The pixels of img from (left, upper) onwards, as a PixelRowSource whose (0,0) is (left, upper)
+ */
+static PixelRowSource CropRows(const PNG &img, unsigned int upper, unsigned int left)
+{
+  return [&img, upper, left](unsigned int x, unsigned int y, unsigned int count, unsigned char *rgba) {
+    for (unsigned int i = 0; i < count; i++)
+    {
+      const RGBAPixel *px = img.getPixel(left + x + i, upper + y);
+      rgba[4 * i] = px->r;
+      rgba[4 * i + 1] = px->g;
+      rgba[4 * i + 2] = px->b;
+      rgba[4 * i + 3] = AlphaToByte(px->a);
+    }
+  };
+}
+
+/**
+ *  The width * height RGBA8 pixels in rgba, as a PixelRowSource
+ */
+static PixelRowSource ScanlineRows(const unsigned char *rgba, unsigned int width)
+{
+  return [rgba, width](unsigned int x, unsigned int y, unsigned int count, unsigned char *out) {
+    memcpy(out, rgba + 4 * ((size_t)y * width + x), 4 * (size_t)count);
+  };
+}
+
+/**
+ *  PNG::computeHash() of the PNG that PNG::readFromFile() would make from the RGBA8 pixels in rgba
+ */
+static size_t ScanlineHash(const unsigned char *rgba, unsigned int width, unsigned int height)
+{
+  hash<float> hashFunction;
+  size_t h = 0;
+  for (unsigned int x = 0; x < width; x++)
+  {
+    for (unsigned int y = 0; y < height; y++)
+    {
+      const unsigned char *pixel = rgba + 4 * ((size_t)y * width + x);
+      h = (h << 1) + h + hashFunction(pixel[0]);
+      h = (h << 1) + h + hashFunction(pixel[1]);
+      h = (h << 1) + h + hashFunction(pixel[2]);
+      h = (h << 1) + h + hashFunction(static_cast<float>(pixel[3] / 255.));
+    }
+  }
+  return h;
+}
+
+/**
+ *  PNG::computeHash() restricted to the rectangle bounded by upper, left, lower and right, visiting
+ *  the pixels in the same order, so that the two agree when the rectangle is the whole image
+ */
+static size_t RegionHash(const PNG &img, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+{
+  hash<float> hashFunction;
+  size_t h = 0;
+  for (unsigned int x = left; x <= right; x++)
+  {
+    for (unsigned int y = upper; y <= lower; y++)
+    {
+      const RGBAPixel *pixel = img.getPixel(x, y);
+      h = (h << 1) + h + hashFunction(pixel->r);
+      h = (h << 1) + h + hashFunction(pixel->g);
+      h = (h << 1) + h + hashFunction(pixel->b);
+      h = (h << 1) + h + hashFunction(static_cast<float>(pixel->a));
+    }
+  }
+  return h;
+}
+
+/**
+ *  The eight running sums at sums[0..7], in SumRecord member order, as a SumRecord
+ */
+static SumRecord RecordFrom(const uint64_t *sums)
+{
+  SumRecord rec;
+  rec.r = sums[0];
+  rec.g = sums[1];
+  rec.b = sums[2];
+  rec.a = sums[3];
+  rec.sqR = sums[4];
+  rec.sqG = sums[5];
+  rec.sqB = sums[6];
+  rec.sqA = sums[7];
+  return rec;
+}
+
+/**
+ *  Start of a Stats cache file, followed by the tables as laid out in memory and then the
+ *  blocked layout's edge arrays. 64 bytes long, so the tables stay on a cache line boundary
+ *  when the file is mapped.
+ */
+struct StatsFileHeader {
+  char magic[8];       // StatsFileMagic
+  uint64_t hash;       // PNG::computeHash() of the source image
+  uint32_t width;
+  uint32_t height;
+  uint32_t layout;     // StatsLayout
+  uint32_t opaque;
+  uint32_t entryBytes;
+  uint32_t reserved;
+  uint64_t tableBytes;
+  uint64_t blockRowCount;
+  uint64_t blockColCount;
+};
+static_assert(sizeof(StatsFileHeader) == 64, "tables must start on a cache line boundary");
+
+// identifies a cache file, and the version of its format
+static const char StatsFileMagic[8] = {'P', 'A', '3', 'S', 'A', 'T', '0', '1'};
+
+/**
+ *  Name of the cache file, within StatsOptions::cacheDirectory, for the tables of an image
+ *  @param imageHash - PNG::computeHash() of the image
+ *  @param width - image width
+ *  @param height - image height
+ *  @param layout - layout of the tables
+ *  @return file name, without a directory
+ */
+string Stats::CacheFileName(size_t imageHash, unsigned int width, unsigned int height, StatsLayout layout)
+{
+  const char *layoutNames[] = {"planar", "interleaved", "blocked"};
+  ostringstream name;
+  name << "stats-" << hex << setw(16) << setfill('0') << imageHash << dec << "-" << width << "x" << height << "-"
+       << layoutNames[static_cast<int>(layout)] << ".sat";
+  return name.str();
+}
+
+/**
+ *  Splits [0, count) into one contiguous chunk per thread and runs work(begin, end) on each chunk,
+ *  returning once all of them are done. Chunk boundaries fall on multiples of grain.
+ */
+static void ParallelFor(unsigned int threads, unsigned int count, unsigned int grain,
+                        const function<void(unsigned int, unsigned int)> &work)
+{
+  unsigned int chunk = (count + threads - 1) / threads;
+  chunk = (chunk + grain - 1) / grain * grain;
+
+  vector<thread> workers;
+  for (unsigned int begin = chunk; begin < count; begin += chunk)
+  {
+    workers.emplace_back(work, begin, min(begin + chunk, count));
+  }
+  work(0, min(chunk, count)); // the calling thread takes the first chunk itself
+  for (thread &worker : workers)
+  {
+    worker.join();
+  }
+}
+
+/**
+ *  Computes/retrieves the sum of a single color channel in a defined rectangular region
+ *  @pre channel is a valid channel identifier
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param channel - one of 'r', 'g', or 'b'
+ *  @param upper - y-coordinate of the upper edge of the rectangular region
+ *  @param left - x-coordinate of the left side of the rectangular region
+ *  @param lower - y-coordinate of the lower edge of the rectangular region
+ *  @param right - x-coordinate of the right side of the rectangular region
+ *  @return the sum of the appropriate color channel values in the defined rectangular area
+ */
+unsigned long Stats::GetColorSum(char channel, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+{
+  if (channel == 'g')
+  {
+    return GetSum<Channel::G>(upper, left, lower, right);
+  }
+  if (channel == 'b')
+  {
+    return GetSum<Channel::B>(upper, left, lower, right);
+  }
+  return GetSum<Channel::R>(upper, left, lower, right);
+}
+
+/**
+ *  Computes/retrieves the sum of alpha values in a defined rectangular region
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param upper - y-coordinate of the upper edge of the rectangular region
+ *  @param left - x-coordinate of the left side of the rectangular region
+ *  @param lower - y-coordinate of the lower edge of the rectangular region
+ *  @param right - x-coordinate of the right side of the rectangular region
+ *  @return the sum of the alpha values in the defined rectangular area
+ */
+double Stats::GetAlphaSum(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+{
+  return static_cast<double>(GetSum<Channel::A>(upper, left, lower, right));
+}
+
+/**
+ *  Computes/retrieves the squared sum of a single color channel in a defined rectangular region
+ *  @pre channel is a valid channel identifier
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param channel - one of 'r', 'g', or 'b'
+ *  @param upper - y-coordinate of the upper edge of the rectangular region
+ *  @param left - x-coordinate of the left side of the rectangular region
+ *  @param lower - y-coordinate of the lower edge of the rectangular region
+ *  @param right - x-coordinate of the right side of the rectangular region
+ *  @return the squared sum of the appropriate color channel values in the defined rectangular area
+ */
+unsigned long Stats::GetColorSumSq(char channel, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+{
+  if (channel == 'g')
+  {
+    return GetSumSq<Channel::G>(upper, left, lower, right);
+  }
+  if (channel == 'b')
+  {
+    return GetSumSq<Channel::B>(upper, left, lower, right);
+  }
+  return GetSumSq<Channel::R>(upper, left, lower, right);
+}
+
+/**
+ *  Computes/retrieves the squared sum of alpha values in a defined rectangular region
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param upper - y-coordinate of the upper edge of the rectangular region
+ *  @param left - x-coordinate of the left side of the rectangular region
+ *  @param lower - y-coordinate of the lower edge of the rectangular region
+ *  @param right - x-coordinate of the right side of the rectangular region
+ *  @return the squared sum of the alpha values in the defined rectangular area
+ */
+double Stats::GetAlphaSumSq(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+{
+  return static_cast<double>(GetSumSq<Channel::A>(upper, left, lower, right));
+}
+
+/**
+ *  Simple function to compute the number of pixels in a defined rectangular region
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param upper - y-coordinate of the upper edge of the rectangular region
+ *  @param left - x-coordinate of the left side of the rectangular region
+ *  @param lower - y-coordinate of the lower edge of the rectangular region
+ *  @param right - x-coordinate of the right side of the rectangular region
+ *  @return the area of the defined rectangular area, in pixels
+ */
+uint64_t Stats::GetRectangleArea(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+{
+  // in 64 bits: a rectangle of a blocked-layout image can hold more than 2^32 pixels
+  uint64_t area = (uint64_t)(lower - upper + 1) * (right - left + 1);
+  return area;
+}
+
+/**
+ *  Parameterized constructor
+ *  Builds the channel sum and squared sum vectors from the supplied input image.
+ *  Each channel sum vector's entry (x,y) will contain the sum of their respective
+ *  color channels of all pixels in the rectangular image region bounded by (0,0) and (x,y).
+ *  Likewise, each channel squared sum vector's entry (x,y) will contain the squared sum of their
+ *  respective color channels of all pixels in the rectangular image region bounded by (0,0) and (x,y).
+ *
+ *  ***DON'T FORGET TO PRE-MULTIPLY THE ALPHA CHANNEL***
+ *
+ *  @param img - input image from which the channel sum vectors will be populated
+ *  @param options - table layout, number of build threads, and where the tables are stored or cached
+ */
+Stats::Stats(const PNG &img, const StatsOptions &options)
+    : Stats(img, 0, 0, img.height() - 1, img.width() - 1, options)
+{
+}
+
+/**
+ *  Region-of-interest constructor
+ *  Builds the tables for the rectangle of img bounded by upper, left, lower and right only, as if
+ *  that rectangle were the whole image: all queries take coordinates relative to its upper left
+ *  corner. Time and memory are proportional to the rectangle, not to img.
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param img - input image
+ *  @param upper - y-coordinate of the upper edge of the region
+ *  @param left - x-coordinate of the left side of the region
+ *  @param lower - y-coordinate of the lower edge of the region
+ *  @param right - x-coordinate of the right side of the region
+ *  @param options - table layout, number of build threads, and where the tables are stored or cached
+ */
+Stats::Stats(const PNG &img, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+             const StatsOptions &options)
+{
+  width = right - left + 1;
+  height = lower - upper + 1;
+  Populate(
+      CropRows(img, upper, left), [&]() { return IsOpaque(img, upper, left, lower, right); },
+      [&]() { return RegionHash(img, upper, left, lower, right); }, options);
+}
+
+/**
+ *  Decoder constructor
+ *  Builds the tables straight from RGBA8 scanlines, as lodepng::decode produces them, folding one
+ *  row at a time into the running sums. No PNG object (16 bytes per pixel) is ever created.
+ *  The results, including the cache key, are those of a Stats built from the decoded PNG.
+ *  @param rgba - width * height pixels, row-major, 4 bytes each in r, g, b, a order
+ *  @param width - image width in pixels
+ *  @param height - image height in pixels
+ *  @param options - table layout, number of build threads, and where the tables are stored or cached
+ */
+Stats::Stats(const unsigned char *rgba, unsigned int width, unsigned int height, const StatsOptions &options)
+{
+  this->width = width;
+  this->height = height;
+  Populate(
+      ScanlineRows(rgba, width), [&]() { return IsOpaque(rgba, (size_t)width * height); },
+      [&]() { return ScanlineHash(rgba, width, height); }, options);
+}
+
+/**
+ *  Shared by the constructors once width and height are set: maps the tables from the cache if
+ *  possible, and otherwise allocates them, builds them from rows and saves them to the cache.
+ *  @param isOpaque - whether every pixel of the source has alpha 1.0
+ *  @param hashOf - the PNG::computeHash() of the source; only called when caching
+ */
+void Stats::Populate(const PixelRowSource &rows, const function<bool()> &isOpaque,
+                     const function<size_t()> &hashOf, const StatsOptions &options)
+{
+  layout = options.layout;
+  spillDirectory = options.spillDirectory;
+  mapped = nullptr;
+  mappedBytes = 0;
+
+  string cachePath;
+  imageHash = 0;
+  if (!options.cacheDirectory.empty())
+  {
+    imageHash = hashOf();
+    cachePath = options.cacheDirectory + "/" + CacheFileName(imageHash, width, height, layout);
+    if (LoadCache(cachePath, imageHash))
+    {
+      return;
+    }
+  }
+
+  cached = false;
+  opaque = isOpaque();
+  // every entry is at most the squared sum of the whole image, or of one block in the blocked layout
+  bool fits = layout == StatsLayout::Blocked || (uint64_t)width * height * 255 * 255 <= UINT32_MAX;
+  entryBytes = fits ? sizeof(uint32_t) : sizeof(uint64_t);
+  AllocateTables();
+  Build(rows, options.threads);
+
+  if (!cachePath.empty())
+  {
+    Save(cachePath, imageHash);
+  }
+}
+
+/**
+ *  Fills the freshly allocated tables from rows
+ *  @param threads - number of threads to build with; see StatsOptions
+ */
+void Stats::Build(const PixelRowSource &rows, unsigned int threads)
+{
+  if (layout == StatsLayout::Blocked)
+  {
+    BuildBlocked(rows);
+    return;
+  }
+
+  if (threads <= 1 || height < 2)
+  {
+    // populate the tables row by row: entry (x,y) is the entry directly above it plus the
+    // running sums of row y from column 0 to x
+    for (unsigned int y = 0; y < height; y++)
+    {
+      PrefixRow(rows, y);
+      if (y > 0)
+      {
+        AddRowAbove(y, 0, width);
+      }
+    }
+    return;
+  }
+
+  // the same two additions per entry, split into an independent pass over rows and then one
+  // over columns; the tables are all integers, so the result is identical to the serial build
+  ParallelFor(threads, height, 1, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int y = begin; y < end; y++)
+    {
+      PrefixRow(rows, y);
+    }
+  });
+  // column bands are whole cache lines wide so that neighbouring threads do not share lines
+  ParallelFor(threads, width, 16, [&](unsigned int begin, unsigned int end) {
+    AccumulateColumns(begin, end);
+  });
+}
+
+/**
+ *  Fills table row y with the running sums of the pixels in row y from column 0 to x.
+ *  @param rows - source of the pixels
+ *  @param y - row to fill
+ */
+void Stats::PrefixRow(const PixelRowSource &rows, unsigned int y)
+{
+  uint64_t rowSums[8 * PrefixRunLength];
+  uint64_t carry[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+  for (unsigned int x0 = 0; x0 < width; x0 += PrefixRunLength)
+  {
+    unsigned int count = min(PrefixRunLength, width - x0);
+    PrefixRun(rows, x0, y, count, carry, rowSums);
+    for (unsigned int i = 0; i < count; i++)
+    {
+      SetCell(x0 + i, y, RecordFrom(rowSums + 8 * i));
+    }
+  }
+}
+
+/**
+ *  Adds row y - 1 into row y over columns [xBegin, xEnd), turning row prefixes into summed-area entries.
+ *  @pre row y - 1 is complete
+ */
+void Stats::AddRowAbove(unsigned int y, unsigned int xBegin, unsigned int xEnd)
+{
+  if (entryBytes == sizeof(uint32_t))
+  {
+    AddRowAboveAs<uint32_t>(y, xBegin, xEnd);
+  }
+  else
+  {
+    AddRowAboveAs<uint64_t>(y, xBegin, xEnd);
+  }
+}
+
+template <typename T>
+void Stats::AddRowAboveAs(unsigned int y, unsigned int xBegin, unsigned int xEnd)
+{
+  // every entry is a run of T in either layout, so this is one flat add per table (planar)
+  // or one over the whole record row (interleaved), which the compiler vectorizes
+  T *base = reinterpret_cast<T *>(tables);
+  if (layout == StatsLayout::Interleaved)
+  {
+    AddInto(base + Index(xBegin, y) * stride, base + Index(xBegin, y - 1) * stride, (xEnd - xBegin) * stride);
+    return;
+  }
+
+  for (size_t slot : slots)
+  {
+    if (slot != NoSlot) // alpha tables are absent for opaque images
+    {
+      AddInto(base + slot + Index(xBegin, y), base + slot + Index(xBegin, y - 1), xEnd - xBegin);
+    }
+  }
+}
+
+/**
+ *  Turns row prefixes into summed-area entries for columns [xBegin, xEnd) by adding each
+ *  entry's upper neighbour, top to bottom.
+ */
+void Stats::AccumulateColumns(unsigned int xBegin, unsigned int xEnd)
+{
+  for (unsigned int y = 1; y < height; y++)
+  {
+    AddRowAbove(y, xBegin, xEnd);
+  }
+}
+
+/**
+ *  Fills the blocked layout from rows, one row of full summed-area entries at a time
+ */
+void Stats::BuildBlocked(const PixelRowSource &rows)
+{
+  const size_t across = BlocksAcross();
+  const uint64_t zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  vector<uint64_t> above(8 * (size_t)width, 0); // full entries of row y - 1
+  vector<uint64_t> row(8 * (size_t)width);      // full entries of row y
+
+  for (unsigned int y = 0; y < height; y++)
+  {
+    uint64_t carry[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (unsigned int x0 = 0; x0 < width; x0 += PrefixRunLength)
+    {
+      PrefixRun(rows, x0, y, min(PrefixRunLength, width - x0), carry, &row[8 * (size_t)x0]);
+    }
+    AddInto(row.data(), above.data(), row.size());
+
+    // the column just left of each block, for this row
+    uint64_t *cols = &blockCols[8 * y * across];
+    for (size_t bx = 1; bx < across; bx++)
+    {
+      copy_n(&row[8 * (bx * BlockSize - 1)], 8, cols + 8 * bx);
+    }
+
+    // entry (x,y) relative to its block is the full entry minus the part of the image above
+    // the block and the part left of it, plus their overlap, which was subtracted twice
+    const uint64_t *rows = &blockRows[8 * (size_t)(y / BlockSize) * width];
+    for (unsigned int x = 0; x < width; x++)
+    {
+      size_t bx = x / BlockSize;
+      const uint64_t *full = &row[8 * (size_t)x];
+      const uint64_t *left = cols + 8 * bx;
+      const uint64_t *up = rows + 8 * (size_t)x;
+      const uint64_t *corner = bx > 0 ? rows + 8 * (bx * BlockSize - 1) : zeros;
+      uint64_t local[8];
+      for (int k = 0; k < 8; k++)
+      {
+        local[k] = full[k] - left[k] - up[k] + corner[k];
+      }
+      SetCell(x, y, RecordFrom(local));
+    }
+
+    // the last row of a block row is the edge above the next one
+    if ((y + 1) % BlockSize == 0 && y + 1 < height)
+    {
+      copy(row.begin(), row.end(), blockRows.begin() + 8 * (size_t)((y + 1) / BlockSize) * width);
+    }
+    swap(above, row);
+  }
+}
 
 /**
- *  Computes/retrieves the sum of a single color channel in a defined rectangular region
- *  @pre channel is a valid channel identifier
- *  @pre upper, left, lower, and right are valid image coordinates
- *  @param channel - one of 'r', 'g', or 'b'
- *  @param upper - y-coordinate of the upper edge of the rectangular region
- *  @param left - x-coordinate of the left side of the rectangular region
- *  @param lower - y-coordinate of the lower edge of the rectangular region
- *  @param right - x-coordinate of the right side of the rectangular region
- *  @return the sum of the appropriate color channel values in the defined rectangular area
+ *  StatsLayout::Blocked - the full summed-area entry for one running sum at (x,y),
+ *  rebuilt from its block-relative entry and the block edges
  */
-unsigned long Stats::GetColorSum(char channel, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+unsigned long Stats::BlockedEntry(unsigned int slot, unsigned int x, unsigned int y) const
+{
+  size_t bx = x / BlockSize;
+  size_t rowEdge = (size_t)(y / BlockSize) * width;
+  uint64_t sum = reinterpret_cast<const uint32_t *>(tables)[slots[slot] + Index(x, y) * stride];
+  sum += blockCols[8 * (y * BlocksAcross() + bx) + slot];
+  sum += blockRows[8 * (rowEdge + x) + slot];
+  if (bx > 0)
+  {
+    sum -= blockRows[8 * (rowEdge + bx * BlockSize - 1) + slot];
+  }
+  return sum;
+}
+
+/**
+ *  StatsLayout::Blocked - all eight full summed-area entries at (x,y)
+ */
+SumRecord Stats::BlockedCell(unsigned int x, unsigned int y) const
+{
+  size_t bx = x / BlockSize;
+  size_t rowEdge = (size_t)(y / BlockSize) * width;
+  SumRecord cell = CellAs<uint32_t>(x, y);
+  Accumulate(cell, RecordFrom(&blockCols[8 * (y * BlocksAcross() + bx)]), 1);
+  Accumulate(cell, RecordFrom(&blockRows[8 * (rowEdge + x)]), 1);
+  if (bx > 0)
+  {
+    Accumulate(cell, RecordFrom(&blockRows[8 * (rowEdge + bx * BlockSize - 1)]), -1);
+  }
+  return cell;
+}
+
+/**
+ *  RectSum for the blocked layout
+ */
+unsigned long Stats::BlockedRectSum(unsigned int slot, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const
 {
-  vector<vector<unsigned long>> *colorptr = nullptr;
-  if (channel == 'r')
+  unsigned long sum = BlockedEntry(slot, right, lower);
+  if (upper > 0)
   {
-    colorptr = &sumR;
+    sum -= BlockedEntry(slot, right, upper - 1);
   }
-  else if (channel == 'g')
+  if (left > 0)
   {
-    colorptr = &sumG;
+    sum -= BlockedEntry(slot, left - 1, lower);
   }
-  else if (channel == 'b')
+  if (upper > 0 && left > 0)
   {
-    colorptr = &sumB;
+    sum += BlockedEntry(slot, left - 1, upper - 1);
   }
+  return sum;
+}
 
-  unsigned long colorSum = 0;
+/**
+ *  Updates the tables in place after the pixels of one rectangle of the image have been replaced,
+ *  so that they match a Stats built from the edited image.
+ *  @pre the rectangle lies within the image
+ *  @param patch - the new pixels; pixel (x,y) of the patch is pixel (left + x, upper + y) of the image
+ *  @param upper - y-coordinate of the upper edge of the replaced rectangle
+ *  @param left - x-coordinate of the left side of the replaced rectangle
+ *  @param threads - worker threads used for the update, each taking a band of rows; 1 updates serially
+ */
+void Stats::Update(const PNG &patch, unsigned int upper, unsigned int left, unsigned int threads)
+{
+  const unsigned int patchWidth = patch.width();
+  const unsigned int lower = upper + patch.height() - 1;
+  const unsigned int right = left + patchWidth - 1;
 
-  if (upper == 0 && left == 0)
+  if (opaque && !IsOpaque(patch, 0, 0, lower - upper, right - left))
   {
-    colorSum = (*colorptr)[right][lower];
+    StoreAlpha();
   }
-  else if (upper == 0)
+  // the tables no longer match the image they were cached for
+  imageHash = 0;
+  cached = false;
+
+  // summed-area table of the change in each pixel's eight sums over the rectangle, built from the
+  // difference between the new and old running sums along each row; the old ones come from the
+  // tables, so this must happen before any entry changes. Unsigned wrap-around stands in for negatives.
+  PixelRowSource patchRows = CropRows(patch, 0, 0);
+  vector<uint64_t> change(8 * (size_t)patchWidth * patch.height());
+  for (unsigned int y = upper; y <= lower; y++)
   {
-    colorSum = (*colorptr)[right][lower] - (*colorptr)[left - 1][lower];
+    uint64_t *row = &change[8 * (size_t)(y - upper) * patchWidth];
+    uint64_t carry[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (unsigned int x0 = 0; x0 < patchWidth; x0 += PrefixRunLength)
+    {
+      PrefixRun(patchRows, x0, y - upper, min(PrefixRunLength, patchWidth - x0), carry, row + 8 * (size_t)x0);
+    }
+    for (unsigned int x = left; x <= right; x++)
+    {
+      SumRecord old = GetAllSums(y, left, y, x);
+      const uint64_t oldSums[8] = {old.r, old.g, old.b, old.a, old.sqR, old.sqG, old.sqB, old.sqA};
+      uint64_t *sums = row + 8 * (size_t)(x - left);
+      for (int k = 0; k < 8; k++)
+      {
+        sums[k] -= oldSums[k];
+      }
+    }
+    if (y > upper)
+    {
+      AddInto(row, row - 8 * (size_t)patchWidth, 8 * (size_t)patchWidth);
+    }
   }
-  else if (left == 0)
+
+  // total change over (0,0) to (x,y); columns and rows before the rectangle are passed as
+  // its left and upper coordinates wrapped below zero, and did not change
+  const uint64_t zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  auto changeTo = [&](unsigned int x, unsigned int y) -> const uint64_t * {
+    if (x < left || y < upper || x == UINT_MAX || y == UINT_MAX)
+    {
+      return zeros;
+    }
+    return &change[8 * ((size_t)(min(y, lower) - upper) * patchWidth + (min(x, right) - left))];
+  };
+
+  if (layout != StatsLayout::Blocked)
   {
-    colorSum = (*colorptr)[right][lower] - (*colorptr)[right][upper - 1];
+    ParallelFor(max(threads, 1u), height - upper, 1, [&](unsigned int begin, unsigned int end) {
+      for (unsigned int y = upper + begin; y < upper + end; y++)
+      {
+        for (unsigned int x = left; x < width; x++)
+        {
+          AddToCell(x, y, changeTo(x, y));
+        }
+      }
+    });
+    return;
   }
-  else
+
+  // blocked: each stored part of a full entry moves by the change over the area it covers
+  const size_t across = BlocksAcross();
+  const unsigned int blockEnd = min(width, (right / BlockSize + 1) * BlockSize); // end of the last block column touched
+  ParallelFor(max(threads, 1u), height - upper, 1, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int y = upper + begin; y < upper + end; y++)
+    {
+      unsigned int y0 = y / BlockSize * BlockSize;
+
+      // block-relative entries, in blocks whose area up to (x,y) can overlap the rectangle
+      if (y0 <= lower)
+      {
+        for (unsigned int x = left; x < blockEnd; x++)
+        {
+          unsigned int x0 = x / BlockSize * BlockSize;
+          const uint64_t *full = changeTo(x, y);
+          const uint64_t *leftOf = changeTo(x0 - 1, y);
+          const uint64_t *above = changeTo(x, y0 - 1);
+          const uint64_t *corner = changeTo(x0 - 1, y0 - 1);
+          uint64_t local[8];
+          for (int k = 0; k < 8; k++)
+          {
+            local[k] = full[k] - leftOf[k] - above[k] + corner[k];
+          }
+          AddToCell(x, y, local);
+        }
+      }
+
+      // the columns just left of each block, in this row
+      for (size_t bx = 1; bx < across; bx++)
+      {
+        const uint64_t *edge = changeTo(bx * BlockSize - 1, y);
+        uint64_t *sums = &blockCols[8 * (y * across + bx)];
+        for (int k = 0; k < 8; k++)
+        {
+          sums[k] += edge[k];
+        }
+      }
+
+      // this row is the edge above the next block row
+      if ((y + 1) % BlockSize == 0 && y + 1 < height)
+      {
+        uint64_t *edges = &blockRows[8 * (size_t)((y + 1) / BlockSize) * width];
+        for (unsigned int x = left; x < width; x++)
+        {
+          const uint64_t *edge = changeTo(x, y);
+          for (int k = 0; k < 8; k++)
+          {
+            edges[8 * (size_t)x + k] += edge[k];
+          }
+        }
+      }
+    }
+  });
+}
+
+/**
+ *  Adds the alpha tables to the tables of an opaque image, filled as if every pixel has alpha 255,
+ *  and clears opaque
+ */
+void Stats::StoreAlpha()
+{
+  Stats old(*this);
+  opaque = false;
+  AllocateTables();
+  blockRows = old.blockRows; // already hold real alpha sums, which the row kernel always computes
+  blockCols = old.blockCols;
+
+  for (unsigned int y = 0; y < height; y++)
   {
-    colorSum = (*colorptr)[right][lower] - (*colorptr)[right][upper - 1] - (*colorptr)[left - 1][lower] + (*colorptr)[left - 1][upper - 1];
+    for (unsigned int x = 0; x < width; x++)
+    {
+      SumRecord cell = entryBytes == sizeof(uint32_t) ? old.CellAs<uint32_t>(x, y) : old.CellAs<uint64_t>(x, y);
+      // entries of the blocked layout cover the pixels from the corner of their block
+      unsigned long n = layout == StatsLayout::Blocked ? (unsigned long)(x % BlockSize + 1) * (y % BlockSize + 1)
+                                                       : (unsigned long)(x + 1) * (y + 1);
+      cell.a = 255 * n;
+      cell.sqA = 255 * 255 * n;
+      SetCell(x, y, cell);
+    }
   }
+}
 
-  return colorSum;
+/**
+ *  Copy constructor duplicates the backing storage and points the tables into the copy.
+ *  @param other - the Stats to be copied
+ */
+Stats::Stats(const Stats &other)
+{
+  width = other.width;
+  height = other.height;
+  layout = other.layout;
+  opaque = other.opaque;
+  entryBytes = other.entryBytes;
+  imageHash = other.imageHash;
+  spillDirectory = other.spillDirectory;
+  cached = false;
+  mapped = nullptr;
+  mappedBytes = 0;
+  AllocateTables();
+  memcpy(tables, other.tables, TableBytes());
+  blockRows = other.blockRows;
+  blockCols = other.blockCols;
 }
 
 /**
- *  Computes/retrieves the sum of alpha values in a defined rectangular region
- *  @pre upper, left, lower, and right are valid image coordinates
- *  @param upper - y-coordinate of the upper edge of the rectangular region
- *  @param left - x-coordinate of the left side of the rectangular region
- *  @param lower - y-coordinate of the lower edge of the rectangular region
- *  @param right - x-coordinate of the right side of the rectangular region
- *  @return the sum of the alpha values in the defined rectangular area
+ *  Overloaded assignment operator; duplicates the backing storage of rhs.
+ *  @param rhs - the right hand side of the assignment statement
  */
-double Stats::GetAlphaSum(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+Stats &Stats::operator=(const Stats &rhs)
+{
+  if (this != &rhs)
+  {
+    width = rhs.width;
+    height = rhs.height;
+    layout = rhs.layout;
+    opaque = rhs.opaque;
+    entryBytes = rhs.entryBytes;
+    imageHash = rhs.imageHash;
+    spillDirectory = rhs.spillDirectory;
+    cached = false;
+    AllocateTables();
+    memcpy(tables, rhs.tables, TableBytes());
+    blockRows = rhs.blockRows;
+    blockCols = rhs.blockCols;
+  }
+  return *this;
+}
+
+/**
+ *  Destructor unmaps the spill or cache file, if any. Heap storage is released by the vector's own destructor.
+ */
+Stats::~Stats()
+{
+  ReleaseMapping();
+}
+
+/**
+ *  Number of bytes of summed-area data held, including the block edges of the blocked layout
+ */
+size_t Stats::MemoryBytes() const
+{
+  return TableBytes() + (blockRows.size() + blockCols.size()) * sizeof(uint64_t);
+}
+
+/**
+ *  Number of bytes occupied by the tables in the current layout and entry width
+ */
+size_t Stats::TableBytes() const
+{
+  size_t n = (size_t)width * height;
+  size_t sums = opaque && layout != StatsLayout::Interleaved ? 6 : 8;
+  return sums * n * entryBytes;
+}
+
+/**
+ *  Sizes storage, or a spill file, for the current layout and entry width and lays the tables
+ *  out in it. Every entry starts at zero. Falls back to the heap if the spill file cannot be made.
+ */
+void Stats::AllocateTables()
 {
-  double alphaSum = 0.0;
-  if (upper == 0 && left == 0)
+  ReleaseMapping();
+  size_t bytes = TableBytes();
+  if (!spillDirectory.empty() && MapSpillFile(bytes))
   {
-    alphaSum = sumA[right][lower];
+    vector<unsigned char>().swap(storage);
+    tables = mapped; // page aligned
   }
-  else if (upper == 0)
+  else
   {
-    alphaSum = sumA[right][lower] - sumA[left - 1][lower];
+    storage.assign(bytes + alignof(SumRecord) - 1, 0);
+    tables = TableBase(storage);
   }
-  else if (left == 0)
+  LayOutTables();
+
+  if (layout == StatsLayout::Blocked)
   {
-    alphaSum = sumA[right][lower] - sumA[right][upper - 1];
+    blockRows.assign(8 * ((height + BlockSize - 1) / BlockSize) * (size_t)width, 0);
+    blockCols.assign(8 * (size_t)height * BlocksAcross(), 0);
   }
   else
   {
-    alphaSum = sumA[right][lower] - sumA[right][upper - 1] - sumA[left - 1][lower] + sumA[left - 1][upper - 1];
+    vector<uint64_t>().swap(blockRows);
+    vector<uint64_t>().swap(blockCols);
   }
-  return alphaSum;
 }
 
 /**
- *  Computes/retrieves the squared sum of a single color channel in a defined rectangular region
- *  @pre channel is a valid channel identifier
- *  @pre upper, left, lower, and right are valid image coordinates
- *  @param channel - one of 'r', 'g', or 'b'
- *  @param upper - y-coordinate of the upper edge of the rectangular region
- *  @param left - x-coordinate of the left side of the rectangular region
- *  @param lower - y-coordinate of the lower edge of the rectangular region
- *  @param right - x-coordinate of the right side of the rectangular region
- *  @return the squared sum of the appropriate color channel values in the defined rectangular area
+ *  Sets slots and stride for the current layout and opacity
  */
-unsigned long Stats::GetColorSumSq(char channel, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+void Stats::LayOutTables()
+{
+
+  // an opaque image has no alpha sums, except in interleaved records, which keep their fixed
+  // shape; the squared sums move up to fill the gap
+  size_t n = (size_t)width * height;
+  size_t step = layout == StatsLayout::Planar ? n : 1;
+  size_t next = 0;
+  for (size_t k = 0; k < 8; k++)
+  {
+    bool alpha = k == ChannelTraits<Channel::A>::Sum || k == ChannelTraits<Channel::A>::SumSq;
+    if (alpha && opaque && layout != StatsLayout::Interleaved)
+    {
+      slots[k] = NoSlot;
+    }
+    else
+    {
+      slots[k] = next;
+      next += step;
+    }
+  }
+  stride = layout == StatsLayout::Planar ? 1 : next;
+}
+
+/**
+ *  Creates a zero-filled spill file of the given size in spillDirectory and maps it into mapped.
+ *  @return false, with a warning printed, if the file could not be created or mapped
+ */
+bool Stats::MapSpillFile(size_t bytes)
 {
-  vector<vector<unsigned long>> *colorptr = nullptr;
-  if (channel == 'r')
+  string path = spillDirectory + "/stats-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
   {
-    colorptr = &sumSqR;
+    cerr << "WARNING: Stats could not create a spill file in " << spillDirectory << ": " << strerror(errno) << endl;
+    cerr << "       : Keeping the tables in memory" << endl;
+    return false;
   }
-  else if (channel == 'g')
+  // the file has no name from here on, so the OS reclaims it once it is unmapped, even after a crash
+  unlink(path.c_str());
+
+  void *mapping = MAP_FAILED;
+  if (bytes > 0 && ftruncate(fd, (off_t)bytes) == 0)
   {
-    colorptr = &sumSqG;
+    mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   }
-  else if (channel == 'b')
+  int error = errno;
+  close(fd); // the mapping keeps the file open
+  if (mapping == MAP_FAILED)
   {
-    colorptr = &sumSqB;
+    cerr << "WARNING: Stats could not map a " << bytes << "-byte spill file in " << spillDirectory << ": "
+         << strerror(error) << endl;
+    cerr << "       : Keeping the tables in memory" << endl;
+    return false;
   }
 
-  unsigned long colorSumSq = 0;
+  mapped = static_cast<unsigned char *>(mapping);
+  mappedBytes = bytes;
+  return true;
+}
+
+/**
+ *  Writes the tables to a cache file that a later Stats over the same image can map instead of
+ *  building; see StatsOptions::cacheDirectory
+ *  @param path - file to write; replaced atomically if it exists
+ *  @param imageHash - PNG::computeHash() of the image the tables were built from
+ *  @return false, with a warning printed, if the file could not be written
+ */
+bool Stats::Save(const string &path, size_t imageHash) const
+{
+  StatsFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, StatsFileMagic, sizeof(header.magic));
+  header.hash = imageHash;
+  header.width = width;
+  header.height = height;
+  header.layout = static_cast<uint32_t>(layout);
+  header.opaque = opaque;
+  header.entryBytes = entryBytes;
+  header.tableBytes = TableBytes();
+  header.blockRowCount = blockRows.size();
+  header.blockColCount = blockCols.size();
+
+  // write under a temporary name and rename, so that a reader never maps a partial file
+  string tmpPath = path + ".tmp";
+  ofstream out(tmpPath, ios::binary | ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(tables), header.tableBytes);
+  out.write(reinterpret_cast<const char *>(blockRows.data()), blockRows.size() * sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(blockCols.data()), blockCols.size() * sizeof(uint64_t));
+  out.close();
+  if (!out || rename(tmpPath.c_str(), path.c_str()) != 0)
+  {
+    cerr << "WARNING: Stats could not write the cache file " << path << endl;
+    remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
 
-  if (upper == 0 && left == 0)
+/**
+ *  Maps the tables from the cache file at path, if it exists and was saved from an image with the
+ *  given hash and this Stats' dimensions and layout. The tables are mapped copy-on-write: nothing
+ *  is read until a query touches it, and the file itself is never modified.
+ *  @return false if there is no usable cache file
+ */
+bool Stats::LoadCache(const string &path, size_t imageHash)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
   {
-    colorSumSq = (*colorptr)[right][lower];
+    return false;
   }
-  else if (upper == 0)
+
+  StatsFileHeader header;
+  struct stat info;
+  bool usable = fstat(fd, &info) == 0 && read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+                memcmp(header.magic, StatsFileMagic, sizeof(header.magic)) == 0 &&
+                header.hash == imageHash && header.width == width && header.height == height &&
+                header.layout == static_cast<uint32_t>(layout) &&
+                (uint64_t)info.st_size == sizeof(header) + header.tableBytes +
+                                              (header.blockRowCount + header.blockColCount) * sizeof(uint64_t);
+  void *mapping = MAP_FAILED;
+  if (usable)
   {
-    colorSumSq = (*colorptr)[right][lower] - (*colorptr)[left - 1][lower];
+    mapping = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
   }
-  else if (left == 0)
+  close(fd);
+  if (mapping == MAP_FAILED)
   {
-    colorSumSq = (*colorptr)[right][lower] - (*colorptr)[right][upper - 1];
+    return false;
   }
-  else
+
+  opaque = header.opaque != 0;
+  entryBytes = header.entryBytes;
+  if (TableBytes() != header.tableBytes)
   {
-    colorSumSq = (*colorptr)[right][lower] - (*colorptr)[right][upper - 1] - (*colorptr)[left - 1][lower] + (*colorptr)[left - 1][upper - 1];
+    munmap(mapping, info.st_size); // written by an incompatible build
+    return false;
   }
 
-  return colorSumSq;
+  cached = true;
+  LayOutTables();
+  mapped = static_cast<unsigned char *>(mapping);
+  mappedBytes = info.st_size;
+  tables = mapped + sizeof(header);
+  const uint64_t *edges = reinterpret_cast<const uint64_t *>(tables + header.tableBytes);
+  blockRows.assign(edges, edges + header.blockRowCount);
+  blockCols.assign(edges + header.blockRowCount, edges + header.blockRowCount + header.blockColCount);
+  return true;
 }
 
 /**
- *  Computes/retrieves the squared sum of alpha values in a defined rectangular region
- *  @pre upper, left, lower, and right are valid image coordinates
- *  @param upper - y-coordinate of the upper edge of the rectangular region
- *  @param left - x-coordinate of the left side of the rectangular region
- *  @param lower - y-coordinate of the lower edge of the rectangular region
- *  @param right - x-coordinate of the right side of the rectangular region
- *  @return the squared sum of the alpha values in the defined rectangular area
+ *  Unmaps the spill or cache file, if any
  */
-double Stats::GetAlphaSumSq(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+void Stats::ReleaseMapping()
 {
-  double alphaSumSq = 0.0;
-  if (upper == 0 && left == 0)
+  if (mapped != nullptr)
   {
-    alphaSumSq = sumSqA[right][lower];
+    munmap(mapped, mappedBytes);
+    mapped = nullptr;
+    mappedBytes = 0;
   }
-  else if (upper == 0)
+}
+
+template <typename T>
+SumRecord Stats::CellAs(unsigned int x, unsigned int y) const
+{
+  const T *entry = reinterpret_cast<const T *>(tables) + Index(x, y) * stride;
+  SumRecord cell;
+  if (layout == StatsLayout::Interleaved)
   {
-    alphaSumSq = sumSqA[right][lower] - sumSqA[left - 1][lower];
+    // slots are 0..7 here; spelling them out lets the whole record be read with a few wide loads
+    cell.r = entry[0];
+    cell.g = entry[1];
+    cell.b = entry[2];
+    cell.a = entry[3];
+    cell.sqR = entry[4];
+    cell.sqG = entry[5];
+    cell.sqB = entry[6];
+    cell.sqA = entry[7];
+    return cell;
   }
-  else if (left == 0)
+
+  cell.r = entry[slots[0]];
+  cell.g = entry[slots[1]];
+  cell.b = entry[slots[2]];
+  cell.sqR = entry[slots[4]];
+  cell.sqG = entry[slots[5]];
+  cell.sqB = entry[slots[6]];
+  if (slots[3] != NoSlot)
   {
-    alphaSumSq = sumSqA[right][lower] - sumSqA[right][upper - 1];
+    cell.a = entry[slots[3]];
+    cell.sqA = entry[slots[7]];
   }
   else
   {
-    alphaSumSq = sumSqA[right][lower] - sumSqA[right][upper - 1] - sumSqA[left - 1][lower] + sumSqA[left - 1][upper - 1];
+    cell.a = 0;
+    cell.sqA = 0;
   }
-  return alphaSumSq;
+  return cell;
 }
 
 /**
- *  Simple function to compute the number of pixels in a defined rectangular region
- *  @pre upper, left, lower, and right are valid image coordinates
- *  @param upper - y-coordinate of the upper edge of the rectangular region
- *  @param left - x-coordinate of the left side of the rectangular region
- *  @param lower - y-coordinate of the lower edge of the rectangular region
- *  @param right - x-coordinate of the right side of the rectangular region
- *  @return the area of the defined rectangular area, in pixels
+ *  Writes all eight running sums of table entry (x,y), whatever the layout and entry width
  */
-unsigned int Stats::GetRectangleArea(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
+void Stats::SetCell(unsigned int x, unsigned int y, const SumRecord &cell)
+{
+  if (entryBytes == sizeof(uint32_t))
+  {
+    SetCellAs<uint32_t>(x, y, cell);
+  }
+  else
+  {
+    SetCellAs<uint64_t>(x, y, cell);
+  }
+}
+
+template <typename T>
+void Stats::SetCellAs(unsigned int x, unsigned int y, const SumRecord &cell)
 {
-  unsigned int area = (lower - upper + 1) * (right - left + 1);
-  return area; // REPLACE THIS STUB
+  const unsigned long sums[8] = {cell.r, cell.g, cell.b, cell.a, cell.sqR, cell.sqG, cell.sqB, cell.sqA};
+  T *entry = reinterpret_cast<T *>(tables) + Index(x, y) * stride;
+  for (size_t k = 0; k < 8; k++)
+  {
+    if (slots[k] != NoSlot)
+    {
+      entry[slots[k]] = static_cast<T>(sums[k]); // fits: entryBytes was chosen for the largest entry
+    }
+  }
 }
 
 /**
- *  Parameterized constructor
- *  Builds the channel sum and squared sum vectors from the supplied input image.
- *  Each channel sum vector's entry (x,y) will contain the sum of their respective
- *  color channels of all pixels in the rectangular image region bounded by (0,0) and (x,y).
- *  Likewise, each channel squared sum vector's entry (x,y) will contain the squared sum of their
- *  respective color channels of all pixels in the rectangular image region bounded by (0,0) and (x,y).
- *
- *  ***DON'T FORGET TO PRE-MULTIPLY THE ALPHA CHANNEL***
- *
- *  @param img - input image from which the channel sum vectors will be populated
+ *  Adds change[0..7], in SumRecord member order, to the eight running sums of table entry (x,y)
+ *  with wrap-around, whatever the layout and entry width. In the blocked layout, this is the
+ *  block-relative entry.
  */
-Stats::Stats(const PNG &img)
+void Stats::AddToCell(unsigned int x, unsigned int y, const uint64_t *change)
 {
-  // initialize sum vectors;
-  sumR.resize(img.width());
-  for (auto &col : sumR)
+  if (entryBytes == sizeof(uint32_t))
+  {
+    AddToCellAs<uint32_t>(x, y, change);
+  }
+  else
   {
-    col.resize(img.height());
+    AddToCellAs<uint64_t>(x, y, change);
   }
-  sumG.resize(img.width());
-  for (auto &col : sumG)
+}
+
+template <typename T>
+void Stats::AddToCellAs(unsigned int x, unsigned int y, const uint64_t *change)
+{
+  T *entry = reinterpret_cast<T *>(tables) + Index(x, y) * stride;
+  for (size_t k = 0; k < 8; k++)
   {
-    col.resize(img.height());
+    if (slots[k] != NoSlot)
+    {
+      entry[slots[k]] += static_cast<T>(change[k]); // exact modulo 2^(8 * sizeof(T)), and the result fits
+    }
   }
-  sumB.resize(img.width());
-  for (auto &col : sumB)
+}
+
+/**
+ *  Computes/retrieves the sums and squared sums of every channel in a defined rectangular
+ *  region at once, reading each of the four corner entries a single time
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param upper - y-coordinate of the upper edge of the rectangular region
+ *  @param left - x-coordinate of the left side of the rectangular region
+ *  @param lower - y-coordinate of the lower edge of the rectangular region
+ *  @param right - x-coordinate of the right side of the rectangular region
+ *  @return all eight channel totals over the defined rectangular area
+ */
+SumRecord Stats::GetAllSums(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const
+{
+  if (layout == StatsLayout::Blocked)
   {
-    col.resize(img.height());
+    return CombineCorners<&Stats::BlockedCell>(upper, left, lower, right);
   }
-  sumA.resize(img.width());
-  for (auto &col : sumA)
+  if (entryBytes == sizeof(uint32_t))
   {
-    col.resize(img.height());
+    return CombineCorners<&Stats::CellAs<uint32_t>>(upper, left, lower, right);
   }
+  return CombineCorners<&Stats::CellAs<uint64_t>>(upper, left, lower, right);
+}
 
-  // initalize sqrSum vectors
-  sumSqR.resize(img.width());
-  for (auto &col : sumSqR)
+template <SumRecord (Stats::*CellOf)(unsigned int, unsigned int) const>
+SumRecord Stats::CombineCorners(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const
+{
+  SumRecord sums = (this->*CellOf)(right, lower);
+  if (upper > 0)
   {
-    col.resize(img.height());
+    Accumulate(sums, (this->*CellOf)(right, upper - 1), -1);
   }
-  sumSqG.resize(img.width());
-  for (auto &col : sumSqG)
+  if (left > 0)
   {
-    col.resize(img.height());
+    Accumulate(sums, (this->*CellOf)(left - 1, lower), -1);
   }
-  sumSqB.resize(img.width());
-  for (auto &col : sumSqB)
+  if (upper > 0 && left > 0)
   {
-    col.resize(img.height());
+    Accumulate(sums, (this->*CellOf)(left - 1, upper - 1), 1);
   }
-  sumSqA.resize(img.width());
-  for (auto &col : sumSqA)
+  if (opaque)
   {
-    col.resize(img.height());
+    // every pixel has alpha 255, so the alpha totals follow from the area alone
+    unsigned long n = (unsigned long)(lower - upper + 1) * (right - left + 1);
+    sums.a = 255 * n;
+    sums.sqA = 255 * 255 * n;
   }
+  return sums;
+}
+
+/**
+ *  Scores every cut of a rectangle in one orientation at once: GatherSplitStrip followed by
+ *  ScoreSplitStrip, with buffers of its own.
+ *  scores[i] is exactly GetSumSqDev of the left (upper) part ending at column left + i
+ *  (row upper + i) plus GetSumSqDev of the right (lower) part.
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param vertical - true to score the vertical cuts, false for the horizontal ones
+ *  @param scores - resized to right - left (lower - upper) combined scores
+ */
+void Stats::GetSplitScores(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                           bool vertical, vector<double> &scores) const
+{
+  vector<uint64_t> strip;
+  GatherSplitStrip(upper, left, lower, right, vertical, strip);
+  ScoreSplitStrip(upper, left, lower, right, vertical, strip, scores);
+}
+
+/**
+ *  Projects a rectangle onto the axis across its cuts. For vertical cuts, every candidate's sums
+ *  come from just two table rows, upper - 1 and lower, so those rows are read once, streaming,
+ *  and their differences over columns left - 1 to right are stored; horizontal cuts use the two
+ *  columns left - 1 and right the same way.
+ *  @pre upper, left, lower, and right are valid image coordinates
+ *  @param vertical - true to project for the vertical cuts, false for the horizontal ones
+ *  @param strip - resized to eight runs of right - left + 2 (lower - upper + 2) running sums, one per
+ *                 SumRecord member in member order; entry j of a run is the sum from the rectangle's
+ *                 start across the cuts to just before coordinate left + j (upper + j).
+ *                 The alpha runs are zero for an opaque image.
+ */
+void Stats::GatherSplitStrip(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                             bool vertical, vector<uint64_t> &strip) const
+{
+  // the cuts run across [first, last]; the rectangle spans [near, far] along them
+  unsigned int first = vertical ? left : upper;
+  unsigned int last = vertical ? right : lower;
+  unsigned int near = vertical ? upper : left;
+  unsigned int far = vertical ? lower : right;
+  size_t count = (size_t)(last - first) + 2;
+  strip.resize(8 * count);
 
-  // populate sumR vector; read 4 pixel to the left and above of x,y and calculate the prefix sum
-  for (size_t x = 0; x < img.width(); x++)
+  if (layout == StatsLayout::Planar || layout == StatsLayout::Interleaved)
   {
-    for (size_t y = 0; y < img.height(); y++)
+    if (entryBytes == sizeof(uint32_t))
+    {
+      GatherStripAs<uint32_t>(near, far, first, count, vertical, strip.data());
+    }
+    else
     {
-      unsigned long r = static_cast<unsigned long> (img.getPixel(x, y)->r);
-      unsigned long g = static_cast<unsigned long> (img.getPixel(x, y)->g);
-      unsigned long b = static_cast<unsigned long> (img.getPixel(x, y)->b);
-      double a = static_cast<double>(img.getPixel(x, y)->a) * 255.0;
-      unsigned long rSq = r * r;
-      unsigned long gSq = g * g;
-      unsigned long bSq = b * b;
-      double aSq = a * a;
+      GatherStripAs<uint64_t>(near, far, first, count, vertical, strip.data());
+    }
+    return;
+  }
 
-      if (x == 0 && y == 0)
+  // blocked entries are assembled from three parts, so they are read one record at a time
+  for (size_t j = 0; j < count; j++)
+  {
+    unsigned int c = first - 1 + (unsigned int)j;
+    SumRecord sums = SumRecord();
+    if (c != UINT_MAX)
+    {
+      sums = vertical ? BlockedCell(c, far) : BlockedCell(far, c);
+      if (near > 0)
       {
-        sumR[x][y] = r;
-        sumG[x][y] = g;
-        sumB[x][y] = b;
-        sumA[x][y] = a;
-        sumSqR[x][y] = rSq;
-        sumSqG[x][y] = gSq;
-        sumSqB[x][y] = bSq;
-        sumSqA[x][y] = aSq;
+        Accumulate(sums, vertical ? BlockedCell(c, near - 1) : BlockedCell(near - 1, c), -1);
       }
-      else if (x == 0)
-      {
+    }
+    const uint64_t record[8] = {sums.r, sums.g, sums.b, opaque ? 0 : sums.a,
+                                sums.sqR, sums.sqG, sums.sqB, opaque ? 0 : sums.sqA};
+    for (int k = 0; k < 8; k++)
+    {
+      strip[k * count + j] = record[k];
+    }
+  }
+}
 
-        sumR[x][y] = r + sumR[x][y - 1];
-        sumG[x][y] = g + sumG[x][y - 1];
-        sumB[x][y] = b + sumB[x][y - 1];
-        sumA[x][y] = a + sumA[x][y - 1];
-        sumSqR[x][y] = sumSqR[x][y - 1] + rSq;
-        sumSqG[x][y] = sumSqG[x][y - 1] + gSq;
-        sumSqB[x][y] = sumSqB[x][y - 1] + bSq;
-        sumSqA[x][y] = sumSqA[x][y - 1] + aSq;
-      }
-      else if (y == 0)
-      {
+template <typename T>
+void Stats::GatherStripAs(unsigned int near, unsigned int far, unsigned int first, size_t count, bool vertical,
+                          uint64_t *strip) const
+{
+  // before column (row) 0 the running sums are zero
+  size_t skip = first == 0 ? 1 : 0;
+  unsigned int c0 = first - 1 + (unsigned int)skip;
+  size_t step = (vertical ? 1 : (size_t)width) * stride;
+  const T *base = reinterpret_cast<const T *>(tables);
+  const T *farEntries = base + (vertical ? Index(c0, far) : Index(far, c0)) * stride;
+  const T *nearEntries = near == 0 ? nullptr : base + (vertical ? Index(c0, near - 1) : Index(near - 1, c0)) * stride;
 
-        sumR[x][y] = r + sumR[x - 1][y];
-        sumG[x][y] = g + sumG[x - 1][y];
-        sumB[x][y] = b + sumB[x - 1][y];
-        sumA[x][y] = a + sumA[x - 1][y];
-        sumSqR[x][y] = sumSqR[x - 1][y] + rSq;
-        sumSqG[x][y] = sumSqG[x - 1][y] + gSq;
-        sumSqB[x][y] = sumSqB[x - 1][y] + bSq;
-        sumSqA[x][y] = sumSqA[x - 1][y] + aSq;
+  for (int k = 0; k < 8; k++)
+  {
+    uint64_t *out = strip + k * count;
+    if (slots[k] == NoSlot || (opaque && (k == 3 || k == 7)))
+    {
+      fill(out, out + count, 0);
+      continue;
+    }
+    if (skip)
+    {
+      out[0] = 0;
+    }
+    const T *farRun = farEntries + slots[k];
+    if (nearEntries == nullptr)
+    {
+      for (size_t j = skip; j < count; j++)
+      {
+        out[j] = farRun[(j - skip) * step];
       }
-      else
+    }
+    else
+    {
+      const T *nearRun = nearEntries + slots[k];
+      for (size_t j = skip; j < count; j++)
       {
-
-        sumR[x][y] = sumR[x - 1][y] + sumR[x][y - 1] - sumR[x - 1][y - 1] + r;
-        sumG[x][y] = sumG[x - 1][y] + sumG[x][y - 1] - sumG[x - 1][y - 1] + g;
-        sumB[x][y] = sumB[x - 1][y] + sumB[x][y - 1] - sumB[x - 1][y - 1] + b;
-        sumA[x][y] = sumA[x - 1][y] + sumA[x][y - 1] - sumA[x - 1][y - 1] + a;
-        sumSqR[x][y] = sumSqR[x - 1][y] + sumSqR[x][y - 1] - sumSqR[x - 1][y - 1] + rSq;
-        sumSqG[x][y] = sumSqG[x - 1][y] + sumSqG[x][y - 1] - sumSqG[x - 1][y - 1] + gSq;
-        sumSqB[x][y] = sumSqB[x - 1][y] + sumSqB[x][y - 1] - sumSqB[x - 1][y - 1] + bSq;
-        sumSqA[x][y] = sumSqA[x - 1][y] + sumSqA[x][y - 1] - sumSqA[x - 1][y - 1] + aSq;
+        out[j] = (uint64_t)farRun[(j - skip) * step] - nearRun[(j - skip) * step];
       }
     }
   }
 }
 
+/**
+ *  Scores every cut of a rectangle from its GatherSplitStrip projection in one linear sweep
+ *  @pre strip was gathered for the same rectangle and orientation
+ *  @param scores - resized to right - left (lower - upper) combined scores, as for GetSplitScores
+ */
+void Stats::ScoreSplitStrip(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                            bool vertical, const vector<uint64_t> &strip, vector<double> &scores) const
+{
+  unsigned int count = vertical ? right - left : lower - upper;
+  unsigned int span = vertical ? lower - upper + 1 : right - left + 1;
+  scores.resize(count);
+  SplitScoresScalar(strip.data(), count, span, opaque, scores.data());
+}
+
 /**
  *  Computes/retrieves the average color of all pixels contained in the rectangle
  *  bounded by upper, left, lower, and right. Fractional values should be
@@ -320,10 +1432,11 @@ Stats::Stats(const PNG &img)
  */
 RGBAPixel Stats::GetAvg(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right)
 {
-  size_t totalR = GetColorSum('r', upper, left, lower, right);
-  size_t totalG = GetColorSum('g', upper, left, lower, right);
-  size_t totalB = GetColorSum('b', upper, left, lower, right);
-  double totalA = GetAlphaSum(upper, left, lower, right);
+  SumRecord sums = GetAllSums(upper, left, lower, right);
+  size_t totalR = sums.r;
+  size_t totalG = sums.g;
+  size_t totalB = sums.b;
+  double totalA = sums.a;
   size_t n = GetRectangleArea(upper, left, lower, right);
 
   unsigned char avgR = totalR / n;
@@ -354,19 +1467,23 @@ double Stats::GetSumSqDev(unsigned int upper, unsigned int left, unsigned int lo
 {
   double n = GetRectangleArea(upper, left, lower, right);
 
-  unsigned long totalR = GetColorSum('r', upper, left, lower, right);
-  unsigned long totalG = GetColorSum('g', upper, left, lower, right);
-  unsigned long totalB = GetColorSum('b', upper, left, lower, right);
-  double totalA = GetAlphaSum(upper, left, lower, right);
+  SumRecord sums = GetAllSums(upper, left, lower, right);
+
+  unsigned long totalR = sums.r;
+  unsigned long totalG = sums.g;
+  unsigned long totalB = sums.b;
+  double totalA = sums.a;
 
-  unsigned long totalSqR = GetColorSumSq('r', upper, left, lower, right);
-  unsigned long totalSqG = GetColorSumSq('g', upper, left, lower, right);
-  unsigned long totalSqB = GetColorSumSq('b', upper, left, lower, right);
-  double totalSqA = GetAlphaSumSq(upper, left, lower, right);
+  unsigned long totalSqR = sums.sqR;
+  unsigned long totalSqG = sums.sqG;
+  unsigned long totalSqB = sums.sqB;
+  double totalSqA = sums.sqA;
 
-  double sqDiffR = totalSqR - totalR * totalR / n;
-  double sqDiffG = totalSqG - totalG * totalG / n; 
-  double sqDiffB = totalSqB - totalB * totalB / n;
+  // the squares are taken in double: the exact 64-bit product would overflow for rectangles
+  // of more than about 16 million pixels, and rounding it to double gives the same value
+  double sqDiffR = totalSqR - (double)totalR * totalR / n;
+  double sqDiffG = totalSqG - (double)totalG * totalG / n;
+  double sqDiffB = totalSqB - (double)totalB * totalB / n;
   double sqDiffA = totalSqA - totalA * totalA / n;
 
   double sumSqDev = sqDiffR + sqDiffG + sqDiffB + sqDiffA;
@@ -12,6 +12,9 @@
 #include "cs221util/PNG.h"
 #include "cs221util/RGBAPixel.h"
 
+#include <cstdint>
+#include <functional>
+#include <string>
 #include <utility>
 #include <vector>
 #include <cmath>
@@ -19,21 +22,82 @@
 using namespace cs221util;
 using namespace std;
 
+/**
+ *  Memory arrangement of the summed-area tables inside a Stats object.
+ */
+enum class StatsLayout {
+    Planar,     // eight separate row-major tables, one per running sum
+    Interleaved, // one record per (x,y) holding all eight running sums side by side, in SumRecord order
+    Blocked      // 32-bit sums relative to each 64x64 block, plus 64-bit sums along the block edges;
+                 // about half the memory of the other layouts with the same exact results. Built serially.
+};
+
+/**
+ *  Construction-time settings for a Stats object.
+ */
+struct StatsOptions {
+    StatsLayout layout = StatsLayout::Planar; // representation of the summed-area tables
+    unsigned int threads = 1;                 // worker threads used to build the tables, and any ImgTree built
+                                              // from them; 1 builds serially
+    string spillDirectory;                    // if not empty, the tables live in a temporary file in this
+                                              // directory, mapped into memory, so that the OS can page them
+                                              // out; otherwise they are allocated on the heap
+    string cacheDirectory;                    // if not empty, tables built for an image are saved in this
+                                              // directory, keyed by the image's hash, dimensions and layout,
+                                              // and a later Stats for the same image maps them instead of
+                                              // building them again
+};
+
+/**
+ *  Source of pixels for building the tables of a Stats object: packs count pixels of row y, starting at
+ *  column x, into rgba as RGBA8 (4 bytes per pixel in r, g, b, a order, alpha pre-multiplied by 255.0).
+ *  Coordinates are those of the tables, which may be offset from those of the underlying image.
+ */
+typedef function<void(unsigned int x, unsigned int y, unsigned int count, unsigned char* rgba)> PixelRowSource;
+
+/**
+ *  All eight running sums for one table entry, or for one rectangle once four entries are combined.
+ *  Exactly one 64-byte cache line; an interleaved table entry is this record at the table's entry
+ *  width, so a 64-byte or 32-byte run that never straddles a line.
+ */
+struct alignas(64) SumRecord {
+    unsigned long r;
+    unsigned long g;
+    unsigned long b;
+    unsigned long a; // alpha as an 8-bit value, i.e. pre-multiplied by 255.0
+    unsigned long sqR;
+    unsigned long sqG;
+    unsigned long sqB;
+    unsigned long sqA; // 8-bit alpha, squared
+};
+
+/**
+ *  Channel identifiers for the compile-time query API, e.g. GetSum<Channel::R>(...)
+ */
+enum class Channel { R, G, B, A };
+
+/**
+ *  Per-channel result type and positions of the channel's two running sums within a table entry
+ *  (SumRecord member order), resolved at compile time. Specialized for each Channel below the Stats class.
+ */
+template <Channel C> struct ChannelTraits;
+
 class Stats {
     public:
-        // 2D vectors to store color channel sums from (0,0) to (x,y)
-        vector<vector<unsigned long>> sumR;
-        vector<vector<unsigned long>> sumG;
-        vector<vector<unsigned long>> sumB;
-        vector<vector<double>> sumA; // alpha channel should be pre-multiplied by 255.0 BEFORE storing,
-                                        // for proportional scaling with the RGB channels
-
-        // 2D vectors to store color channel squared sums from (0,0) to (x,y)
-        vector<vector<unsigned long>> sumSqR;
-        vector<vector<unsigned long>> sumSqG;
-        vector<vector<unsigned long>> sumSqB;
-        vector<vector<double>> sumSqA; // alpha channel should be pre-multiplied by 255.0 BEFORE storing,
-                                        // for proportional scaling with the RGB channels
+        // The summed-area tables are flat and row-major: the entry for (x,y) holds the sums from
+        // (0,0) to (x,y) and lives at index y * width + x. All tables are carved out of one
+        // contiguous allocation (see storage).
+        unsigned int width;      // number of columns in each table, i.e. the image width
+        unsigned int height;     // number of rows in each table, i.e. the image height
+        StatsLayout layout;      // representation of the tables, see StatsLayout
+        bool opaque;             // true if every pixel has alpha 1.0; alpha sums then follow from the area alone
+                                 // and the planar layout does not store the two alpha tables
+        unsigned int entryBytes; // 4 if every entry fits in a uint32_t, i.e. width * height * 255^2 < 2^32,
+                                 // or in the blocked layout; 8 (uint64_t entries) otherwise
+        bool cached;             // true if the tables were mapped from a cache file rather than built,
+                                 // and have not been updated since
+        size_t imageHash;        // PNG::computeHash() of the source if the tables are cached, 0 otherwise;
+                                 // the key, with the dimensions, of anything cached for the same image
 
         /**
          *  Computes/retrieves the sum of a single color channel in a defined rectangular region
@@ -83,6 +147,46 @@ class Stats {
          */
         double GetAlphaSumSq(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right);
 
+        /**
+         *  Computes/retrieves the sum of one channel in a defined rectangular region, with the
+         *  channel fixed at compile time so no per-call channel selection is needed
+         *  @tparam C - the channel to sum; Channel::A yields the pre-multiplied alpha sum
+         *  @pre upper, left, lower, and right are valid image coordinates
+         *  @param upper - y-coordinate of the upper edge of the rectangular region
+         *  @param left - x-coordinate of the left side of the rectangular region
+         *  @param lower - y-coordinate of the lower edge of the rectangular region
+         *  @param right - x-coordinate of the right side of the rectangular region
+         *  @return the sum of the channel's values in the defined rectangular area
+         */
+        template <Channel C>
+        typename ChannelTraits<C>::type GetSum(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const;
+
+        /**
+         *  Computes/retrieves the squared sum of one channel in a defined rectangular region,
+         *  with the channel fixed at compile time
+         *  @tparam C - the channel to sum; Channel::A yields the pre-multiplied alpha squared sum
+         *  @pre upper, left, lower, and right are valid image coordinates
+         *  @param upper - y-coordinate of the upper edge of the rectangular region
+         *  @param left - x-coordinate of the left side of the rectangular region
+         *  @param lower - y-coordinate of the lower edge of the rectangular region
+         *  @param right - x-coordinate of the right side of the rectangular region
+         *  @return the squared sum of the channel's values in the defined rectangular area
+         */
+        template <Channel C>
+        typename ChannelTraits<C>::type GetSumSq(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const;
+
+        /**
+         *  Computes/retrieves the sums and squared sums of every channel in a defined rectangular
+         *  region at once, reading each of the four corner entries a single time
+         *  @pre upper, left, lower, and right are valid image coordinates
+         *  @param upper - y-coordinate of the upper edge of the rectangular region
+         *  @param left - x-coordinate of the left side of the rectangular region
+         *  @param lower - y-coordinate of the lower edge of the rectangular region
+         *  @param right - x-coordinate of the right side of the rectangular region
+         *  @return all eight channel totals over the defined rectangular area
+         */
+        SumRecord GetAllSums(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const;
+
         /**
          *  Simple function to compute the number of pixels in a defined rectangular region
          *  @pre upper, left, lower, and right are valid image coordinates
@@ -92,7 +196,22 @@ class Stats {
          *  @param right - x-coordinate of the right side of the rectangular region
          *  @return the area of the defined rectangular area, in pixels
          */
-        unsigned int GetRectangleArea(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right);
+        uint64_t GetRectangleArea(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right);
+
+        /**
+         *  Number of bytes of summed-area data held, including the block edges of the blocked layout
+         */
+        size_t MemoryBytes() const;
+
+        /**
+         *  Name of the cache file, within StatsOptions::cacheDirectory, for the tables of an image
+         *  @param imageHash - PNG::computeHash() of the image
+         *  @param width - image width
+         *  @param height - image height
+         *  @param layout - layout of the tables
+         *  @return file name, without a directory
+         */
+        static string CacheFileName(size_t imageHash, unsigned int width, unsigned int height, StatsLayout layout);
 
     public:
         /**
@@ -105,9 +224,68 @@ class Stats {
          * 
          *  ***DON'T FORGET TO PRE-MULTIPLY THE ALPHA CHANNEL***
          * 
+         *  Images whose pixels are all fully opaque are detected up front; their alpha tables are not
+         *  stored and every query derives the alpha sums from the rectangle area instead.
+         *  Table entries are 32-bit when the largest possible entry, width * height * 255^2, fits in
+         *  32 bits, which halves the memory touched for images up to about 256 x 256; 64-bit otherwise.
+         *  Alpha is accumulated as an exact 8-bit integer (alpha * 255), like the RGB channels; an alpha
+         *  that is not a multiple of 1/255, which PNG decoding never produces, is rounded to the nearest one.
+         *  Row running sums are computed by the widest vector kernel the CPU supports (see stats-simd.h).
+         *  The blocked layout keeps each entry relative to its 64x64 block, and is always built serially.
+         *  Otherwise, with more than one thread, each thread first computes the running sums along its own
+         *  band of rows, then each thread accumulates its own band of columns downwards. The result
+         *  is bit-identical to the serial build.
+         *  With a cache directory, the image is hashed first, and none of the above happens if a cache
+         *  file for it already exists; the tables are mapped from that file instead.
+         *
          *  @param img - input image from which the channel sum vectors will be populated
+         *  @param options - table layout, number of build threads, and where the tables are stored or cached
+         */
+        Stats(const PNG& img, const StatsOptions& options = StatsOptions());
+
+        /**
+         *  Region-of-interest constructor
+         *  Builds the tables for the rectangle of img bounded by upper, left, lower and right only, as if
+         *  that rectangle were the whole image: all queries take coordinates relative to its upper left
+         *  corner. Time and memory are proportional to the rectangle, not to img.
+         *  @pre upper, left, lower, and right are valid image coordinates
+         *  @param img - input image
+         *  @param upper - y-coordinate of the upper edge of the region
+         *  @param left - x-coordinate of the left side of the region
+         *  @param lower - y-coordinate of the lower edge of the region
+         *  @param right - x-coordinate of the right side of the region
+         *  @param options - table layout, number of build threads, and where the tables are stored or cached
+         */
+        Stats(const PNG& img, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+              const StatsOptions& options = StatsOptions());
+
+        /**
+         *  Decoder constructor
+         *  Builds the tables straight from RGBA8 scanlines, as lodepng::decode produces them, folding one
+         *  row at a time into the running sums. No PNG object (16 bytes per pixel) is ever created.
+         *  The results, including the cache key, are those of a Stats built from the decoded PNG.
+         *  @param rgba - width * height pixels, row-major, 4 bytes each in r, g, b, a order
+         *  @param width - image width in pixels
+         *  @param height - image height in pixels
+         *  @param options - table layout, number of build threads, and where the tables are stored or cached
          */
-        Stats(const PNG& img);
+        Stats(const unsigned char* rgba, unsigned int width, unsigned int height,
+              const StatsOptions& options = StatsOptions());
+
+        /**
+         *  Updates the tables in place after the pixels of one rectangle of the image have been replaced,
+         *  so that they match a Stats built from the edited image.
+         *  Only the entries at or below and right of the rectangle's upper left corner change, each by
+         *  the total change within the part of the rectangle it covers. The blocked layout only touches
+         *  the blocks that overlap the rectangle, and the block edges below and right of it.
+         *  A first translucent pixel in an opaque image brings back the alpha tables, which takes a full copy.
+         *  @pre the rectangle lies within the image
+         *  @param patch - the new pixels; pixel (x,y) of the patch is pixel (left + x, upper + y) of the image
+         *  @param upper - y-coordinate of the upper edge of the replaced rectangle
+         *  @param left - x-coordinate of the left side of the replaced rectangle
+         *  @param threads - worker threads used for the update, each taking a band of rows; 1 updates serially
+         */
+        void Update(const PNG& patch, unsigned int upper, unsigned int left, unsigned int threads = 1);
 
         /**
          *  Computes/retrieves the average color of all pixels contained in the rectangle
@@ -140,10 +318,334 @@ class Stats {
         double GetSumSqDev(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right);
 
         /**
-         *  Note that a destructor is not needed for this class, as the vectors will have their
-         *  own destructors automatically called by the compiler-provided destructor when a Stats
-         *  object goes out of scope.
+         *  Scores every cut of a rectangle in one orientation at once: GatherSplitStrip followed by
+         *  ScoreSplitStrip, with buffers of its own.
+         *  scores[i] is exactly GetSumSqDev of the left (upper) part ending at column left + i
+         *  (row upper + i) plus GetSumSqDev of the right (lower) part.
+         *  @pre upper, left, lower, and right are valid image coordinates
+         *  @param vertical - true to score the vertical cuts, false for the horizontal ones
+         *  @param scores - resized to right - left (lower - upper) combined scores
+         */
+        void GetSplitScores(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                            bool vertical, vector<double>& scores) const;
+
+        /**
+         *  Projects a rectangle onto the axis across its cuts. For vertical cuts, every candidate's sums
+         *  come from just two table rows, upper - 1 and lower, so those rows are read once, streaming,
+         *  and their differences over columns left - 1 to right are stored; horizontal cuts use the two
+         *  columns left - 1 and right the same way.
+         *  @pre upper, left, lower, and right are valid image coordinates
+         *  @param vertical - true to project for the vertical cuts, false for the horizontal ones
+         *  @param strip - resized to eight runs of right - left + 2 (lower - upper + 2) running sums, one per
+         *                 SumRecord member in member order; entry j of a run is the sum from the rectangle's
+         *                 start across the cuts to just before coordinate left + j (upper + j).
+         *                 The alpha runs are zero for an opaque image.
+         */
+        void GatherSplitStrip(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                              bool vertical, vector<uint64_t>& strip) const;
+
+        /**
+         *  Scores every cut of a rectangle from its GatherSplitStrip projection in one linear sweep
+         *  @pre strip was gathered for the same rectangle and orientation
+         *  @param scores - resized to right - left (lower - upper) combined scores, as for GetSplitScores
+         */
+        void ScoreSplitStrip(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right,
+                             bool vertical, const vector<uint64_t>& strip, vector<double>& scores) const;
+
+        /**
+         *  Copy constructor duplicates the backing storage and points the tables into the copy.
+         *  A copy of a Stats whose tables are in a spill file gets a spill file of its own.
+         *  @param other - the Stats to be copied
+         */
+        Stats(const Stats& other);
+
+        /**
+         *  Overloaded assignment operator; duplicates the backing storage of rhs.
+         *  @param rhs - the right hand side of the assignment statement
+         */
+        Stats& operator=(const Stats& rhs);
+
+        /**
+         *  Destructor unmaps the spill or cache file, if any. Heap storage is released by the vector's own destructor.
+         */
+        ~Stats();
+
+    private:
+        // backing memory for the tables when they are on the heap, with slack to start them on a
+        // cache line boundary; empty when they are in a spill file.
+        // Planar: the eight tables back to back, in SumRecord member order, each width * height
+        // entries long. Interleaved: width * height records of eight entries each. Blocked: width * height
+        // records of the stored sums, each relative to the top left corner of its block.
+        vector<unsigned char> storage;
+
+        /**
+         *  Number of bytes occupied by the tables in the current layout and entry width
+         */
+        size_t TableBytes() const;
+
+        // first table entry, on a cache line boundary inside storage or at the start of the spill mapping
+        unsigned char* tables;
+
+        // directory for spill files, or empty for heap storage; see StatsOptions
+        string spillDirectory;
+
+        // mapping of the file holding the tables - an (already unlinked) spill file, or a cache file -
+        // or nullptr if they are on the heap
+        unsigned char* mapped;
+        size_t mappedBytes;
+
+        /**
+         *  Creates a zero-filled spill file of the given size in spillDirectory and maps it into mapped.
+         *  @return false, with a warning printed, if the file could not be created or mapped
+         */
+        bool MapSpillFile(size_t bytes);
+
+        /**
+         *  Unmaps the spill or cache file, if any
+         */
+        void ReleaseMapping();
+
+        /**
+         *  Writes the tables to a cache file that a later Stats over the same image can map instead of
+         *  building; see StatsOptions::cacheDirectory
+         *  @param path - file to write; replaced atomically if it exists
+         *  @param imageHash - PNG::computeHash() of the image the tables were built from
+         *  @return false, with a warning printed, if the file could not be written
+         */
+        bool Save(const string& path, size_t imageHash) const;
+
+        /**
+         *  Maps the tables from the cache file at path, if it exists and was saved from an image with the
+         *  given hash and this Stats' dimensions and layout. The tables are mapped copy-on-write: nothing
+         *  is read until a query touches it, and the file itself is never modified.
+         *  @return false if there is no usable cache file
+         */
+        bool LoadCache(const string& path, size_t imageHash);
+
+        // position of each of the eight running sums (SumRecord member order) within the tables,
+        // counted in entries: running sum k of table entry i is element slots[k] + i * stride.
+        // Planar: slots are whole tables apart and stride is 1; interleaved: slots are 0..7 and stride is 8;
+        // blocked: slots are consecutive and stride is the number of stored sums.
+        // Opaque images have no alpha sums outside the interleaved layout; their alpha slots are NoSlot.
+        size_t slots[8];
+        size_t stride;
+
+        static const size_t NoSlot = (size_t)-1;
+
+        // StatsLayout::Blocked - side length of a block, small enough that any sum within one fits in 32 bits
+        static const unsigned int BlockSize = 64;
+
+        // StatsLayout::Blocked - full summed-area entries along the block edges, eight per position:
+        // blockRows holds entry (x, by * BlockSize - 1) at position by * width + x, i.e. the row just
+        // above block row by; blockCols holds entry (bx * BlockSize - 1, y) at position y * BlocksAcross() + bx,
+        // i.e. the column just left of block column bx. Positions on the image's top or left edge are zero.
+        // Both are empty in the other layouts.
+        vector<uint64_t> blockRows;
+        vector<uint64_t> blockCols;
+
+        /**
+         *  Number of block columns, counting a partial block at the right edge
+         */
+        size_t BlocksAcross() const { return (width + BlockSize - 1) / BlockSize; }
+
+        /**
+         *  Sizes storage, or a spill file, for the current layout and entry width and lays the tables
+         *  out in it. Every entry starts at zero. Falls back to the heap if the spill file cannot be made.
+         */
+        void AllocateTables();
+
+        /**
+         *  Sets slots and stride for the current layout and opacity
          */
+        void LayOutTables();
+
+        /**
+         *  Shared by the constructors once width and height are set: maps the tables from the cache if
+         *  possible, and otherwise allocates them, builds them from rows and saves them to the cache.
+         *  @param isOpaque - whether every pixel of the source has alpha 1.0
+         *  @param hashOf - the PNG::computeHash() of the source; only called when caching
+         */
+        void Populate(const PixelRowSource& rows, const function<bool()>& isOpaque,
+                      const function<size_t()>& hashOf, const StatsOptions& options);
+
+        /**
+         *  Fills the freshly allocated tables from rows
+         *  @param threads - number of threads to build with; see StatsOptions
+         */
+        void Build(const PixelRowSource& rows, unsigned int threads);
+
+        /**
+         *  Fills table row y with the running sums of the pixels in row y from column 0 to x.
+         *  @param rows - source of the pixels
+         *  @param y - row to fill
+         */
+        void PrefixRow(const PixelRowSource& rows, unsigned int y);
+
+        /**
+         *  Adds row y - 1 into row y over columns [xBegin, xEnd), turning row prefixes into summed-area entries.
+         *  @pre row y - 1 is complete
+         */
+        void AddRowAbove(unsigned int y, unsigned int xBegin, unsigned int xEnd);
+
+        /**
+         *  Turns row prefixes into summed-area entries for columns [xBegin, xEnd) by adding each
+         *  entry's upper neighbour, top to bottom.
+         */
+        void AccumulateColumns(unsigned int xBegin, unsigned int xEnd);
+
+        /**
+         *  Fills the blocked layout from rows, one row of full summed-area entries at a time
+         */
+        void BuildBlocked(const PixelRowSource& rows);
+
+        /**
+         *  StatsLayout::Blocked - the full summed-area entry for one running sum at (x,y),
+         *  rebuilt from its block-relative entry and the block edges
+         */
+        unsigned long BlockedEntry(unsigned int slot, unsigned int x, unsigned int y) const;
+
+        /**
+         *  StatsLayout::Blocked - all eight full summed-area entries at (x,y)
+         */
+        SumRecord BlockedCell(unsigned int x, unsigned int y) const;
+
+        /**
+         *  Writes all eight running sums of table entry (x,y), whatever the layout and entry width.
+         *  In the blocked layout, cell holds the block-relative sums.
+         */
+        void SetCell(unsigned int x, unsigned int y, const SumRecord& cell);
+
+        /**
+         *  Adds change[0..7], in SumRecord member order, to the eight running sums of table entry (x,y)
+         *  with wrap-around, whatever the layout and entry width. In the blocked layout, this is the
+         *  block-relative entry.
+         */
+        void AddToCell(unsigned int x, unsigned int y, const uint64_t* change);
+
+        /**
+         *  Adds the alpha tables to the tables of an opaque image, filled as if every pixel has alpha 255,
+         *  and clears opaque
+         */
+        void StoreAlpha();
+
+        /**
+         *  Flat index of entry (x,y) in any of the tables
+         */
+        size_t Index(unsigned int x, unsigned int y) const { return (size_t)y * width + x; }
+
+        /**
+         *  Versions of the functions above for entries of type T, which must match entryBytes.
+         *  Each public entry point picks the instantiation once per call.
+         */
+        template <typename T> void AddRowAboveAs(unsigned int y, unsigned int xBegin, unsigned int xEnd);
+        template <typename T> SumRecord CellAs(unsigned int x, unsigned int y) const; // reads all eight running sums of entry (x,y)
+        template <typename T> void SetCellAs(unsigned int x, unsigned int y, const SumRecord& cell);
+        template <typename T> void AddToCellAs(unsigned int x, unsigned int y, const uint64_t* change);
+
+        /**
+         *  GetAllSums, reading the four corner entries with CellOf
+         */
+        template <SumRecord (Stats::*CellOf)(unsigned int, unsigned int) const>
+        SumRecord CombineCorners(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const;
+
+        /**
+         *  GatherSplitStrip for the planar and interleaved layouts with entries of type T: each run is
+         *  the difference of two equally spaced sequences of entries
+         *  @param near, far - the rectangle's extent along the cuts
+         *  @param first - the first coordinate across the cuts; count - number of entries per run
+         */
+        template <typename T>
+        void GatherStripAs(unsigned int near, unsigned int far, unsigned int first, size_t count, bool vertical,
+                           uint64_t* strip) const;
+
+        /**
+         *  RectSum for the blocked layout
+         */
+        unsigned long BlockedRectSum(unsigned int slot, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const;
+
+        /**
+         *  Four-corner summed-area lookup shared by all of the single-channel Get...Sum functions
+         *  @param slot - position of the running sum within an entry, in SumRecord member order
+         *  @return the sum of the running sum's values over the defined rectangular area
+         */
+        unsigned long RectSum(unsigned int slot, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const;
+
+        /**
+         *  RectSum for entries of type T. Intermediate differences may wrap around, but the
+         *  rectangle total fits in T, so the modular result is exact.
+         */
+        template <typename T>
+        T RectSumAs(unsigned int slot, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const;
+};
+
+template <> struct ChannelTraits<Channel::R> {
+    typedef unsigned long type;
+    static const unsigned int Sum = 0;
+    static const unsigned int SumSq = 4;
+};
+
+template <> struct ChannelTraits<Channel::G> {
+    typedef unsigned long type;
+    static const unsigned int Sum = 1;
+    static const unsigned int SumSq = 5;
 };
 
+template <> struct ChannelTraits<Channel::B> {
+    typedef unsigned long type;
+    static const unsigned int Sum = 2;
+    static const unsigned int SumSq = 6;
+};
+
+template <> struct ChannelTraits<Channel::A> {
+    typedef unsigned long type;
+    static const unsigned int Sum = 3;
+    static const unsigned int SumSq = 7;
+};
+
+template <typename T>
+inline T Stats::RectSumAs(unsigned int slot, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const
+{
+    const T* table = reinterpret_cast<const T*>(tables) + slots[slot];
+    T sum = table[Index(right, lower) * stride];
+    if (upper > 0) {
+        sum -= table[Index(right, upper - 1) * stride];
+    }
+    if (left > 0) {
+        sum -= table[Index(left - 1, lower) * stride];
+    }
+    if (upper > 0 && left > 0) {
+        sum += table[Index(left - 1, upper - 1) * stride];
+    }
+    return sum;
+}
+
+inline unsigned long Stats::RectSum(unsigned int slot, unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const
+{
+    if (layout == StatsLayout::Blocked) {
+        return BlockedRectSum(slot, upper, left, lower, right);
+    }
+    if (entryBytes == sizeof(uint32_t)) {
+        return RectSumAs<uint32_t>(slot, upper, left, lower, right);
+    }
+    return RectSumAs<uint64_t>(slot, upper, left, lower, right);
+}
+
+template <Channel C>
+inline typename ChannelTraits<C>::type Stats::GetSum(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const
+{
+    if (C == Channel::A && opaque) {
+        return 255 * (unsigned long)(lower - upper + 1) * (right - left + 1);
+    }
+    return RectSum(ChannelTraits<C>::Sum, upper, left, lower, right);
+}
+
+template <Channel C>
+inline typename ChannelTraits<C>::type Stats::GetSumSq(unsigned int upper, unsigned int left, unsigned int lower, unsigned int right) const
+{
+    if (C == Channel::A && opaque) {
+        return 255 * 255 * (unsigned long)(lower - upper + 1) * (right - left + 1);
+    }
+    return RectSum(ChannelTraits<C>::SumSq, upper, left, lower, right);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,115 @@
+/**
+ *  @file taskpool.cpp
+ *  @description a small work-stealing task pool for fork-join work such as building the
+ *   two subtrees of an ImgTree node in parallel
+ *
+ *  THIS FILE WILL NOT BE SUBMITTED TO PRAIRIELEARN
+ */
+
+#include "taskpool.h"
+
+#include <thread>
+
+// index of the pool thread running on this OS thread, for Spawn
+static thread_local unsigned int currentWorker = 0;
+
+TaskPool::TaskPool(unsigned int threads)
+{
+  this->threads = threads < 1 ? 1 : threads;
+  for (unsigned int i = 0; i < this->threads; i++)
+  {
+    queues.emplace_back(new Queue());
+  }
+  pending = 0;
+  queued = 0;
+}
+
+void TaskPool::Run(const Task &root)
+{
+  pending = 1;
+  queued = 1;
+  queues[0]->tasks.push_back(root);
+
+  vector<thread> workers;
+  for (unsigned int i = 1; i < threads; i++)
+  {
+    workers.emplace_back(&TaskPool::Work, this, i);
+  }
+  unsigned int outer = currentWorker;
+  Work(0);
+  currentWorker = outer;
+  for (thread &worker : workers)
+  {
+    worker.join();
+  }
+}
+
+void TaskPool::Spawn(Task task)
+{
+  pending++;
+  {
+    Queue &queue = *queues[currentWorker];
+    lock_guard<mutex> guard(queue.lock);
+    queue.tasks.push_back(move(task));
+    queued++;
+  }
+  // a thread about to sleep holds idleLock from its last look at queued until it waits, so
+  // taking the lock here means it either sees this task or gets this signal
+  {
+    lock_guard<mutex> guard(idleLock);
+  }
+  wake.notify_one();
+}
+
+void TaskPool::Work(unsigned int self)
+{
+  currentWorker = self;
+  Task task;
+  while (pending > 0)
+  {
+    if (!Take(self, task))
+    {
+      unique_lock<mutex> idle(idleLock);
+      wake.wait(idle, [this]() { return pending == 0 || queued > 0; });
+      continue;
+    }
+    task();
+    task = nullptr;
+    // after the task has spawned all of its children, so this never reaches 0 early
+    if (--pending == 0)
+    {
+      {
+        lock_guard<mutex> guard(idleLock);
+      }
+      wake.notify_all();
+    }
+  }
+}
+
+bool TaskPool::Take(unsigned int self, Task &task)
+{
+  {
+    Queue &own = *queues[self];
+    lock_guard<mutex> guard(own.lock);
+    if (!own.tasks.empty())
+    {
+      task = move(own.tasks.back());
+      own.tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+  for (unsigned int i = 1; i < threads; i++)
+  {
+    Queue &victim = *queues[(self + i) % threads];
+    lock_guard<mutex> guard(victim.lock);
+    if (!victim.tasks.empty())
+    {
+      task = move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
\ No newline at end of file
@@ -0,0 +1,78 @@
+/**
+ *  @file taskpool.h
+ *  @description a small work-stealing task pool for fork-join work such as building the
+ *   two subtrees of an ImgTree node in parallel
+ *
+ *  THIS FILE WILL NOT BE SUBMITTED TO PRAIRIELEARN
+ */
+
+#ifndef _TASKPOOL_H_
+#define _TASKPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+/**
+ *  Runs a root task and every task it spawns, transitively, on a fixed number of threads.
+ *  Each thread keeps its own queue: it runs its newest task first, depth-first like the serial
+ *  recursion, and when its queue is empty it steals the oldest task, usually the largest piece
+ *  of work left, from another thread's queue. A thread that finds every queue empty sleeps until
+ *  a task is spawned or the last one finishes.
+ */
+class TaskPool {
+    public:
+        typedef function<void()> Task;
+
+        /**
+         *  @param threads - number of threads to run tasks on, including the one that calls Run
+         */
+        TaskPool(unsigned int threads);
+
+        /**
+         *  Runs root on the calling thread and the rest of the pool, returning once root and every
+         *  task spawned from it have finished. Everything the tasks wrote is visible to the caller.
+         */
+        void Run(const Task& root);
+
+        /**
+         *  Queues task to run on some thread of the pool.
+         *  @pre called from a task of this pool that is still running
+         */
+        void Spawn(Task task);
+
+    private:
+        /**
+         *  One thread's tasks: the owner pushes and pops at the back, thieves take from the front
+         */
+        struct Queue {
+            mutex lock;
+            deque<Task> tasks;
+        };
+
+        unsigned int threads;
+        vector<unique_ptr<Queue>> queues; // queues[i] belongs to thread i; thread 0 is the caller of Run
+        atomic<size_t> pending;            // tasks spawned and not yet finished
+        atomic<size_t> queued;             // tasks in the queues, not yet taken by a thread
+        mutex idleLock;                    // held to check for work before sleeping on wake, and to signal it
+        condition_variable wake;           // signalled when a task is queued or pending reaches 0
+
+        /**
+         *  Runs tasks on thread self until no task is pending anywhere
+         */
+        void Work(unsigned int self);
+
+        /**
+         *  Takes the next task for thread self: its own newest, or else another thread's oldest
+         *  @return false if every queue was empty
+         */
+        bool Take(unsigned int self, Task& task);
+};
+
+#endif
\ No newline at end of file